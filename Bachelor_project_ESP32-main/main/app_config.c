@@ -0,0 +1,258 @@
+/*
+ * app_config.c
+ *
+ *  Older firmware stored every field as its own string key. The first boot that finds no
+ *  blob reads those keys once, writes the blob and erases them.
+ *
+ *  The parsed config is mirrored in RTC memory with a CRC. Deep sleep wakes take it from
+ *  there and NVS is only initialised when something needs flash (WiFi driver, a config
+ *  write, the provisioning request).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "app_config.h"
+#include "wake_prof.h"
+
+#define TAG_CONFIG "APP_CONFIG"
+
+app_config_t app_config;
+
+typedef struct {
+	uint32_t generation;							// bumped on every refresh from NVS or write
+	uint32_t crc;									// over generation and config
+	app_config_t config;
+} app_config_mirror_t;
+
+RTC_DATA_ATTR static app_config_mirror_t config_mirror;
+
+static bool storage_ready = false;
+
+//checks on the field list, a bad entry fails the build instead of truncating at runtime
+#define APP_CONFIG_CHECK_U32(member, size) \
+	_Static_assert((size) == 0, #member ": numbers take no size");
+#define APP_CONFIG_CHECK_STR(member, size) \
+	_Static_assert((size) > 1 && (size) <= APP_CONFIG_STR_MAX + 1, #member ": strings hold 1 to APP_CONFIG_STR_MAX characters"); \
+	_Static_assert(sizeof(((app_config_t *)0)->member) == (size), #member ": size mismatch");
+#define APP_CONFIG_CHECK(member, key, tag, type, size) \
+	_Static_assert((tag) > 0 && (tag) < 32, #member ": tag out of range"); \
+	_Static_assert(sizeof(key) <= NVS_KEY_NAME_MAX_SIZE, #member ": key too long for NVS"); \
+	APP_CONFIG_CHECK_##type(member, size)
+APP_CONFIG_FIELDS(APP_CONFIG_CHECK)
+_Static_assert(sizeof(app_config_t) <= UINT16_MAX, "app_config_t size field overflows");
+
+#define APP_CONFIG_MAX_LEN_U32(size) APP_CONFIG_U32_DIGITS
+#define APP_CONFIG_MAX_LEN_STR(size) ((size) - 1)
+#define APP_CONFIG_ENTRY(member, key, tag, type, size) \
+	{ key, tag, APP_CONFIG_TYPE_##type, offsetof(app_config_t, member), APP_CONFIG_MAX_LEN_##type(size) },
+
+const app_config_field_t app_config_fields[] = {
+	APP_CONFIG_FIELDS(APP_CONFIG_ENTRY)
+};
+const size_t app_config_field_count = sizeof(app_config_fields) / sizeof(app_config_fields[0]);
+
+//key_len characters of key, so a BLUFI "key:value" message can be matched in place
+const app_config_field_t *app_config_find_key(const char *key, size_t key_len) {
+	for (int i = 0; i < app_config_field_count; i++) {
+		if (strlen(app_config_fields[i].key) == key_len && strncmp(app_config_fields[i].key, key, key_len) == 0) {
+			return &app_config_fields[i];
+		}
+	}
+	return NULL;
+}
+
+const app_config_field_t *app_config_find_tag(uint8_t tag) {
+	for (int i = 0; i < app_config_field_count; i++) {
+		if (app_config_fields[i].tag == tag) {
+			return &app_config_fields[i];
+		}
+	}
+	return NULL;
+}
+
+//fill one field from its string form, used by BLUFI and the migration
+esp_err_t app_config_set(const app_config_field_t *field, const char *value) {
+	uint8_t *dest = (uint8_t *)&app_config + field->offset;
+
+	if (field->type == APP_CONFIG_TYPE_U32) {
+		uint32_t number = (uint32_t)strtoul(value, NULL, 10);
+		memcpy(dest, &number, sizeof(number));
+	} else {
+		strlcpy((char *)dest, value, field->max_len + 1);
+	}
+	return ESP_OK;
+}
+
+static uint32_t mirror_crc(void) {
+	uint32_t crc = esp_crc32_le(0, (const uint8_t *)&config_mirror.generation, sizeof(config_mirror.generation));
+	return esp_crc32_le(crc, (const uint8_t *)&config_mirror.config, sizeof(config_mirror.config));
+}
+
+static void mirror_update(void) {
+	config_mirror.generation++;
+	config_mirror.config = app_config;
+	config_mirror.crc = mirror_crc();
+}
+
+//the mirror only survives deep sleep, any other reset reloads RTC data
+static bool mirror_valid(void) {
+	return esp_reset_reason() == ESP_RST_DEEPSLEEP && config_mirror.crc == mirror_crc()
+			&& config_mirror.config.version == APP_CONFIG_VERSION && config_mirror.config.size == sizeof(app_config_t);
+}
+
+//the next boot reads NVS again, used before restarting into the other image which cannot update this mirror
+void app_config_mirror_invalidate(void) {
+	config_mirror.crc = ~mirror_crc();
+}
+
+//nvs_flash_init scans every NVS page, so it only runs once something needs flash
+esp_err_t app_config_storage_on(void) {
+	if (storage_ready) {
+		return ESP_OK;
+	}
+	wake_prof_begin(WAKE_PROF_NVS);
+	esp_err_t ret = nvs_flash_init();
+	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+		ESP_ERROR_CHECK(nvs_flash_erase());
+		ret = nvs_flash_init();
+	}
+	wake_prof_end(WAKE_PROF_NVS);
+	storage_ready = (ret == ESP_OK);
+	return ret;
+}
+
+static esp_err_t write_blob(nvs_handle_t nvs_handle) {
+	app_config.version = APP_CONFIG_VERSION;
+	app_config.size = sizeof(app_config);
+	esp_err_t err = nvs_set_blob(nvs_handle, APP_CONFIG_NVS_KEY, &app_config, sizeof(app_config));
+	if (err == ESP_OK) {
+		err = nvs_commit(nvs_handle);
+	}
+	return err;
+}
+
+//read the legacy string keys into app_config, store the blob and drop the keys
+static esp_err_t migrate_legacy_keys(void) {
+	char value[APP_CONFIG_STR_MAX + 1];
+	nvs_handle_t nvs_handle;
+	int found = 0;
+
+	esp_err_t err = nvs_open(APP_CONFIG_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+	if (err != ESP_OK) {
+		return err;
+	}
+	for (int i = 0; i < app_config_field_count; i++) {
+		size_t len = sizeof(value);
+		if (nvs_get_str(nvs_handle, app_config_fields[i].key, value, &len) == ESP_OK) {
+			app_config_set(&app_config_fields[i], value);
+			found++;
+		}
+	}
+	if (found > 0) {
+		err = write_blob(nvs_handle);
+		if (err == ESP_OK) {
+			for (int i = 0; i < app_config_field_count; i++) {
+				nvs_erase_key(nvs_handle, app_config_fields[i].key);
+			}
+			nvs_commit(nvs_handle);
+			ESP_LOGI(TAG_CONFIG, "Migrated %d legacy keys to the config blob", found);
+		}
+	}
+	nvs_close(nvs_handle);
+	return err;
+}
+
+//rewrite a blob from an older firmware with the fields it did not have, they are still 0
+static void upgrade_blob(size_t len) {
+	nvs_handle_t nvs_handle;
+
+	esp_err_t err = nvs_open(APP_CONFIG_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+	if (err == ESP_OK) {
+		err = write_blob(nvs_handle);
+		nvs_close(nvs_handle);
+	}
+	if (err != ESP_OK) {
+		//the short blob still loads next boot, only the write is retried
+		ESP_LOGW(TAG_CONFIG, "Config blob upgrade from %u bytes failed: %s", (unsigned)len, esp_err_to_name(err));
+		return;
+	}
+	ESP_LOGI(TAG_CONFIG, "Config blob upgraded from %u to %u bytes", (unsigned)len, (unsigned)sizeof(app_config));
+}
+
+//one nvs_get_blob into app_config. A shorter blob of the same version was written before
+//fields were appended, it is copied as far as it goes and the rest stays zeroed
+static esp_err_t load_from_nvs(void) {
+	nvs_handle_t nvs_handle;
+	size_t len = sizeof(app_config);
+
+	memset(&app_config, 0, sizeof(app_config));
+	esp_err_t err = app_config_storage_on();
+	if (err != ESP_OK) {
+		return err;
+	}
+	err = nvs_open(APP_CONFIG_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+	if (err == ESP_OK) {
+		err = nvs_get_blob(nvs_handle, APP_CONFIG_NVS_KEY, &app_config, &len);
+		nvs_close(nvs_handle);
+	}
+
+	if (err == ESP_OK && len >= offsetof(app_config_t, timer_min) && len <= sizeof(app_config)
+			&& app_config.version == APP_CONFIG_VERSION && app_config.size == len) {
+		if (len < sizeof(app_config)) {
+			upgrade_blob(len);
+		}
+		return ESP_OK;
+	}
+	if (err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH) {
+		//another layout version, or written by a newer firmware with more fields, the device has to be provisioned again
+		ESP_LOGE(TAG_CONFIG, "Config blob version %u size %u not supported", app_config.version, (unsigned)len);
+		memset(&app_config, 0, sizeof(app_config));
+		return ESP_ERR_INVALID_VERSION;
+	}
+	memset(&app_config, 0, sizeof(app_config));
+	//namespace or blob missing, first boot after an update from the per-key strings
+	return migrate_legacy_keys();
+}
+
+//from the RTC mirror on deep sleep wakes, otherwise from NVS
+esp_err_t app_config_load(void) {
+	int64_t start_us = esp_timer_get_time();
+	esp_err_t err = ESP_OK;
+	bool from_rtc = mirror_valid();
+
+	if (from_rtc) {
+		app_config = config_mirror.config;
+	} else {
+		err = load_from_nvs();
+		if (err == ESP_OK) {
+			mirror_update();
+		}
+	}
+	ESP_LOGI(TAG_CONFIG, "Config generation %lu loaded from %s in %lld us", (unsigned long)config_mirror.generation,
+			from_rtc ? "RTC" : "NVS", esp_timer_get_time() - start_us);
+	return err;
+}
+
+esp_err_t app_config_save(void) {
+	nvs_handle_t nvs_handle;
+	esp_err_t err = app_config_storage_on();
+	if (err == ESP_OK) {
+		err = nvs_open(APP_CONFIG_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+	}
+	if (err != ESP_OK) {
+		return err;
+	}
+	err = write_blob(nvs_handle);
+	nvs_close(nvs_handle);
+	if (err == ESP_OK) {
+		mirror_update();
+	}
+	return err;
+}
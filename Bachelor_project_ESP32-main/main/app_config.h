@@ -0,0 +1,75 @@
+/*
+ * app_config.h
+ *
+ *  Device configuration (name, server uri, sample timer, upload cadence, continuous period,
+ *  period cap) kept as one versioned blob in NVS. It is read into static storage with a single
+ *  nvs_get_blob at boot, the numeric fields are parsed once when they are set over BLUFI.
+ *  Deep sleep wakes use a copy in RTC memory and do not initialise NVS at all.
+ */
+
+#ifndef MAIN_APP_CONFIG_H_
+#define MAIN_APP_CONFIG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define APP_CONFIG_NVS_NAMESPACE "custom_storage"	// shared with the legacy per-key strings
+#define APP_CONFIG_NVS_KEY "config"
+#define APP_CONFIG_VERSION 1						// bump only when existing fields move or change, older blobs are then refused
+
+/* Every config field, in blob order. The struct, the field table used for NVS migration,
+   BLUFI "key:value" and bulk messages, and the RTC mirror are all generated from this list.
+   The list is append-only: a new field goes at the end and keeps the version, a shorter blob
+   from an older firmware then loads with the new fields at 0 and is rewritten at full size.
+   X(member, key, bulk tag, type, string size including the terminator, 0 for numbers).
+   Keys are the BLUFI prefixes and the legacy NVS keys, tags must stay below 32. */
+#define APP_CONFIG_FIELDS(X) \
+	X(timer_min,    "timer",      3, U32, 0)		/* sample period in minutes, 0 when not set */ \
+	X(upload_every, "upload",     4, U32, 0)		/* samples per upload, 0 when not set */ \
+	X(continuous_s, "continuous", 5, U32, 0)		/* continuous mode sample period, 0 for deep sleep */ \
+	X(name,         "name",       1, STR, APP_CONFIG_STR_MAX + 1) \
+	X(uri,          "uri",        2, STR, APP_CONFIG_STR_MAX + 1) \
+	X(max_period_s, "maxperiod",  6, U32, 0)		/* cap of the battery policy sample period in seconds, 0 for the default */
+
+#define APP_CONFIG_U32_DIGITS 10					// longest decimal value accepted for a number
+#define APP_CONFIG_STR_MAX 256						// longest string value, fits one BLUFI custom data message
+
+typedef enum {
+	APP_CONFIG_TYPE_U32,
+	APP_CONFIG_TYPE_STR,
+} app_config_type_t;
+
+#define APP_CONFIG_MEMBER_U32(member, size) uint32_t member;
+#define APP_CONFIG_MEMBER_STR(member, size) char member[size];
+#define APP_CONFIG_MEMBER(member, key, tag, type, size) APP_CONFIG_MEMBER_##type(member, size)
+
+typedef struct {
+	uint16_t version;
+	uint16_t size;									// sizeof(app_config_t) when written
+	APP_CONFIG_FIELDS(APP_CONFIG_MEMBER)
+} app_config_t;
+
+typedef struct {
+	const char *key;
+	uint8_t tag;
+	app_config_type_t type;
+	uint16_t offset;
+	uint16_t max_len;								// longest value in its string form, without the terminator
+} app_config_field_t;
+
+extern app_config_t app_config;
+extern const app_config_field_t app_config_fields[];
+extern const size_t app_config_field_count;
+
+const app_config_field_t *app_config_find_key(const char *key, size_t key_len);
+const app_config_field_t *app_config_find_tag(uint8_t tag);
+
+esp_err_t app_config_storage_on(void);
+esp_err_t app_config_load(void);
+esp_err_t app_config_set(const app_config_field_t *field, const char *value);
+esp_err_t app_config_save(void);
+void app_config_mirror_invalidate(void);
+
+#endif /* MAIN_APP_CONFIG_H_ */
@@ -0,0 +1,157 @@
+/*
+ * app_fsm.c
+ *
+ *  The dispatcher runs in the task that calls app_fsm_run and blocks on the queue between
+ *  events, so the CPU idles (and scales its clock down) whenever nothing is happening.
+ */
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "app_fsm.h"
+
+#define TAG_FSM "APP_FSM"
+
+static const char *state_names[APP_STATE_COUNT] = {
+		[APP_STATE_BOOT] = "BOOT",
+		[APP_STATE_SENSE] = "SENSE",
+		[APP_STATE_UPLINK] = "UPLINK",
+		[APP_STATE_PROVISION] = "PROVISION",
+		[APP_STATE_SLEEP] = "SLEEP",
+};
+
+static const char *event_names[APP_EVENT_COUNT] = {
+		[APP_EVENT_START] = "start",
+		[APP_EVENT_BUTTON] = "button",
+		[APP_EVENT_SENSOR_READY] = "sensor_ready",
+		[APP_EVENT_WIFI_GOT_IP] = "wifi_got_ip",
+		[APP_EVENT_WIFI_FAILED] = "wifi_failed",
+		[APP_EVENT_UPLOAD_DONE] = "upload_done",
+		[APP_EVENT_SENSOR_TIMEOUT] = "sensor_timeout",
+		[APP_EVENT_WIFI_TIMEOUT] = "wifi_timeout",
+		[APP_EVENT_CANCEL_WINDOW] = "cancel_window",
+		[APP_EVENT_PROVISION_TIMEOUT] = "provision_timeout",
+		[APP_EVENT_PERIOD] = "period",
+};
+
+static QueueHandle_t event_queue = NULL;
+static StaticQueue_t event_queue_buffer;
+static uint8_t event_queue_storage[APP_FSM_QUEUE_LEN * sizeof(app_event_t)];
+static const app_fsm_transition_t *transitions;
+static size_t transition_count;
+static const app_fsm_enter_t *enter_actions;
+static app_state_t current_state = APP_STATE_BOOT;
+
+//one esp_timer per timer event, created on first use
+static esp_timer_handle_t event_timers[APP_EVENT_COUNT];
+
+void app_fsm_init(const app_fsm_transition_t *table, size_t table_len, const app_fsm_enter_t *on_enter) {
+	transitions = table;
+	transition_count = table_len;
+	enter_actions = on_enter;
+	current_state = APP_STATE_BOOT;
+	if (event_queue == NULL) {
+		event_queue = xQueueCreateStatic(APP_FSM_QUEUE_LEN, sizeof(app_event_t), event_queue_storage, &event_queue_buffer);
+	}
+}
+
+//safe to call before app_fsm_init, the event is dropped
+bool app_fsm_post(app_event_type_t type, uint32_t arg) {
+	if (event_queue == NULL) {
+		return false;
+	}
+	app_event_t event = { .type = type, .arg = arg, .time_us = esp_timer_get_time() };
+	if (xQueueSend(event_queue, &event, 0) != pdTRUE) {
+		ESP_LOGE(TAG_FSM, "queue full, %s dropped", event_names[type]);
+		return false;
+	}
+	return true;
+}
+
+bool IRAM_ATTR app_fsm_post_from_isr(app_event_type_t type, uint32_t arg) {
+	BaseType_t higher_priority_woken = pdFALSE;
+	if (event_queue == NULL) {
+		return false;
+	}
+	app_event_t event = { .type = type, .arg = arg, .time_us = esp_timer_get_time() };
+	BaseType_t ret = xQueueSendFromISR(event_queue, &event, &higher_priority_woken);
+	portYIELD_FROM_ISR(higher_priority_woken);
+	return ret == pdTRUE;
+}
+
+static void app_fsm_timer_callback(void *arg) {
+	app_fsm_post((app_event_type_t)(uintptr_t)arg, 0);
+}
+
+//(re)start the timer that posts the given event, a running one is restarted
+void app_fsm_start_timer(app_event_type_t type, uint32_t timeout_ms, bool periodic) {
+	if (event_timers[type] == NULL) {
+		const esp_timer_create_args_t timer_args = {
+				.callback = &app_fsm_timer_callback,
+				.arg = (void *)(uintptr_t)type,
+				.dispatch_method = ESP_TIMER_TASK,
+				.name = event_names[type],
+				.skip_unhandled_events = true,
+		};
+		ESP_ERROR_CHECK(esp_timer_create(&timer_args, &event_timers[type]));
+	}
+	esp_timer_stop(event_timers[type]);
+	if (periodic) {
+		esp_timer_start_periodic(event_timers[type], (uint64_t)timeout_ms * 1000);
+	} else {
+		esp_timer_start_once(event_timers[type], (uint64_t)timeout_ms * 1000);
+	}
+}
+
+void app_fsm_stop_timer(app_event_type_t type) {
+	if (event_timers[type] != NULL) {
+		esp_timer_stop(event_timers[type]);
+	}
+}
+
+app_state_t app_fsm_state(void) {
+	return current_state;
+}
+
+static const app_fsm_transition_t *app_fsm_find(app_state_t state, app_event_type_t type) {
+	for (size_t i = 0; i < transition_count; i++) {
+		if (transitions[i].state == state && transitions[i].event == type) {
+			return &transitions[i];
+		}
+	}
+	return NULL;
+}
+
+//dispatch events forever, events without a row for the current state are ignored
+void app_fsm_run(void) {
+	app_event_t event;
+
+	while (1) {
+		xQueueReceive(event_queue, &event, portMAX_DELAY);
+		int64_t start_us = esp_timer_get_time();
+
+		const app_fsm_transition_t *transition = app_fsm_find(current_state, event.type);
+		if (transition == NULL) {
+			ESP_LOGD(TAG_FSM, "%s ignored in %s", event_names[event.type], state_names[current_state]);
+			continue;
+		}
+
+		app_state_t previous = current_state;
+		app_state_t next = transition->handler(&event);
+
+		//traced before the entry action, entering SLEEP does not return
+		ESP_LOGI(TAG_FSM, "%lld ms: %s --%s--> %s, queued %lld us, handled in %lld us",
+				event.time_us / 1000, state_names[previous], event_names[event.type], state_names[next],
+				start_us - event.time_us, esp_timer_get_time() - start_us);
+
+		if (next != previous) {
+			current_state = next;
+			if (enter_actions[next] != NULL) {
+				enter_actions[next](&event);
+			}
+		}
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * app_fsm.h
+ *
+ *  Application state machine. Every mode change goes through one queue of typed events from
+ *  the button ISR, WiFi, the sensor readers and esp_timer timeouts. The transition table lives
+ *  in main.c, this module queues, dispatches and traces.
+ */
+
+#ifndef MAIN_APP_FSM_H_
+#define MAIN_APP_FSM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define APP_FSM_QUEUE_LEN 16
+
+typedef enum {
+	APP_STATE_BOOT,
+	APP_STATE_SENSE,							// sensors sampling, WiFi associating on upload wakes
+	APP_STATE_UPLINK,							// posting to the server, then the cancel window
+	APP_STATE_PROVISION,						// BLUFI advertising
+	APP_STATE_SLEEP,							// deep sleep, or light sleep in continuous mode
+	APP_STATE_COUNT
+} app_state_t;
+
+typedef enum {
+	APP_EVENT_START,
+	APP_EVENT_BUTTON,
+	APP_EVENT_SENSOR_READY,						// arg is the APP_SENSOR_* that has its first sample
+	APP_EVENT_WIFI_GOT_IP,
+	APP_EVENT_WIFI_FAILED,						// retries exhausted
+	APP_EVENT_UPLOAD_DONE,
+	//timer events, fired by app_fsm_start_timer
+	APP_EVENT_SENSOR_TIMEOUT,
+	APP_EVENT_WIFI_TIMEOUT,
+	APP_EVENT_CANCEL_WINDOW,
+	APP_EVENT_PROVISION_TIMEOUT,
+	APP_EVENT_PERIOD,
+	APP_EVENT_COUNT
+} app_event_type_t;
+
+#define APP_SENSOR_BME280 (1 << 0)
+#define APP_SENSOR_MAX17048 (1 << 1)
+
+typedef struct {
+	app_event_type_t type;
+	uint32_t arg;
+	int64_t time_us;							// esp_timer time the event was posted
+} app_event_t;
+
+//returns the next state, returning the current state keeps it without running its entry action
+typedef app_state_t (*app_fsm_handler_t)(const app_event_t *event);
+typedef void (*app_fsm_enter_t)(const app_event_t *event);
+
+typedef struct {
+	app_state_t state;
+	app_event_type_t event;
+	app_fsm_handler_t handler;
+} app_fsm_transition_t;
+
+void app_fsm_init(const app_fsm_transition_t *table, size_t table_len, const app_fsm_enter_t *on_enter);
+bool app_fsm_post(app_event_type_t type, uint32_t arg);
+bool app_fsm_post_from_isr(app_event_type_t type, uint32_t arg);
+void app_fsm_start_timer(app_event_type_t type, uint32_t timeout_ms, bool periodic);
+void app_fsm_stop_timer(app_event_type_t type);
+app_state_t app_fsm_state(void);
+void app_fsm_run(void);
+
+#endif /* MAIN_APP_FSM_H_ */
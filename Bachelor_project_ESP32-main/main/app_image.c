@@ -0,0 +1,233 @@
+/*
+ * app_image.c
+ *
+ *  Switching between the images goes through otadata and always through esp_restart: the
+ *  sensing image selects the factory partition when provisioning is needed, the provisioning
+ *  image selects ota_0 again instead of its first deep sleep. The bootloader skips the RTC
+ *  segments on a deep sleep wake, the other image would run on this image's RTC data and
+ *  wake stub, so a switch never happens across deep sleep. The reason for the restart is
+ *  passed in NVS.
+ *
+ *  esp_restart reloads RTC_DATA_ATTR as well, so the RTC state that has to outlive the switch
+ *  (sample ring, sleep grid, battery trend, stats, DNS cache) is written to NVS right before the
+ *  restart and restored at the next boot. Each blob is only restored when its size matches, an image
+ *  with another layout starts that module fresh. The wake_prof history is per firmware anyway.
+ */
+#include <stdio.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_image_format.h"
+#include "esp_system.h"
+#include "nvs_flash.h"
+
+#include "app_image.h"
+#include "sleep_sched.h"
+#include "app_config.h"
+#include "sample_buf.h"
+#include "batt_policy.h"
+#include "mem_stats.h"
+#include "wake_guard.h"
+#include "uplink.h"
+
+#define TAG_IMAGE "APP_IMAGE"
+
+#define PROVISION_REQUEST_BUTTON 1
+#define PROVISION_REQUEST_FALLBACK 2				// WiFi failed, BLE mode times out
+
+#define HANDOVER_WAKE 1								// the next image carries on with the wake
+#define HANDOVER_SLEEP 2							// the wake is done, the next image goes straight to deep sleep
+
+//RTC state saved before a switch, the keys live in APP_IMAGE_NVS_NAMESPACE
+static const struct {
+	const char *key;
+	void *(*state)(size_t *len);
+} handover_state[] = {
+		{ "h_samples", sample_buf_rtc_state },
+		{ "h_sched",   sleep_sched_rtc_state },
+		{ "h_batt",    batt_policy_rtc_state },
+		{ "h_mem",     mem_stats_rtc_state },
+		{ "h_guard",   wake_guard_rtc_state },
+		{ "h_dns",     uplink_rtc_state },
+};
+#define HANDOVER_STATE_COUNT (sizeof(handover_state) / sizeof(handover_state[0]))
+
+//right before esp_restart, the marker is written last so a failed save restores nothing.
+//Without it the other image still starts, only with fresh RTC state
+static void handover_save(uint8_t handover) {
+	nvs_handle_t nvs_handle;
+	esp_err_t err = nvs_open(APP_IMAGE_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG_IMAGE, "Failed to save the RTC state: %s", esp_err_to_name(err));
+		return;
+	}
+	for (int i = 0; i < HANDOVER_STATE_COUNT && err == ESP_OK; i++) {
+		size_t len;
+		void *state = handover_state[i].state(&len);
+		err = nvs_set_blob(nvs_handle, handover_state[i].key, state, len);
+	}
+	if (err == ESP_OK) {
+		err = nvs_set_u8(nvs_handle, APP_IMAGE_NVS_HANDOVER_KEY, handover);
+	}
+	if (err == ESP_OK) {
+		err = nvs_commit(nvs_handle);
+	}
+	nvs_close(nvs_handle);
+	if (err != ESP_OK) {
+		ESP_LOGW(TAG_IMAGE, "Failed to save the RTC state: %s", esp_err_to_name(err));
+	}
+}
+
+//after esp_restart only, deep sleep wakes and power on keep or reset the RTC state themselves
+bool app_image_restore_state(bool *wake_done) {
+	nvs_handle_t nvs_handle;
+	uint8_t handover = 0;
+	int restored = 0;
+
+	*wake_done = false;
+	if (esp_reset_reason() != ESP_RST_SW) {
+		return false;
+	}
+	if (app_config_storage_on() != ESP_OK || nvs_open(APP_IMAGE_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+		return false;
+	}
+	if (nvs_get_u8(nvs_handle, APP_IMAGE_NVS_HANDOVER_KEY, &handover) != ESP_OK) {
+		nvs_close(nvs_handle);
+		return false;
+	}
+	for (int i = 0; i < HANDOVER_STATE_COUNT; i++) {
+		size_t len, stored_len = 0;
+		void *state = handover_state[i].state(&len);
+		if (nvs_get_blob(nvs_handle, handover_state[i].key, NULL, &stored_len) == ESP_OK && stored_len == len
+				&& nvs_get_blob(nvs_handle, handover_state[i].key, state, &stored_len) == ESP_OK) {
+			restored++;
+		} else {
+			ESP_LOGW(TAG_IMAGE, "%s not restored, the other image has another layout", handover_state[i].key);
+		}
+		nvs_erase_key(nvs_handle, handover_state[i].key);
+	}
+	//a later restart of the same image must not go back to this state
+	nvs_erase_key(nvs_handle, APP_IMAGE_NVS_HANDOVER_KEY);
+	nvs_commit(nvs_handle);
+	nvs_close(nvs_handle);
+
+	*wake_done = (handover == HANDOVER_SLEEP);
+	ESP_LOGI(TAG_IMAGE, "restored %d of %d RTC states from the other image", restored, (int)HANDOVER_STATE_COUNT);
+	return true;
+}
+
+//true once after app_image_restart_into_provisioning, only the provisioning image takes the request
+bool app_image_provisioning_requested(bool *fallback) {
+	*fallback = false;
+#if CONFIG_BT_ENABLED
+	nvs_handle_t nvs_handle;
+	uint8_t request = 0;
+	//the request always comes with esp_restart, deep sleep wakes do not need NVS for it
+	if (esp_reset_reason() == ESP_RST_DEEPSLEEP) {
+		return false;
+	}
+	if (app_config_storage_on() != ESP_OK || nvs_open(APP_IMAGE_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) != ESP_OK) {
+		return false;
+	}
+	if (nvs_get_u8(nvs_handle, APP_IMAGE_NVS_REQUEST_KEY, &request) == ESP_OK) {
+		nvs_erase_key(nvs_handle, APP_IMAGE_NVS_REQUEST_KEY);
+		nvs_commit(nvs_handle);
+	}
+	nvs_close(nvs_handle);
+
+	*fallback = (request == PROVISION_REQUEST_FALLBACK);
+	return request != 0;
+#else
+	return false;
+#endif
+}
+
+//store the request, boot the factory partition and restart, returns only if that is not possible
+void app_image_restart_into_provisioning(bool fallback) {
+	nvs_handle_t nvs_handle;
+	esp_err_t err = app_config_storage_on();
+	if (err == ESP_OK) {
+		err = nvs_open(APP_IMAGE_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+	}
+	if (err == ESP_OK) {
+		err = nvs_set_u8(nvs_handle, APP_IMAGE_NVS_REQUEST_KEY, fallback ? PROVISION_REQUEST_FALLBACK : PROVISION_REQUEST_BUTTON);
+		if (err == ESP_OK) {
+			err = nvs_commit(nvs_handle);
+		}
+		nvs_close(nvs_handle);
+	}
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG_IMAGE, "Failed to store the provisioning request: %s", esp_err_to_name(err));
+		return;
+	}
+
+	const esp_partition_t *factory = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, NULL);
+	if (factory == NULL) {
+		ESP_LOGE(TAG_IMAGE, "No provisioning image in the partition table");
+		return;
+	}
+	if (esp_ota_get_running_partition() != factory) {
+		err = esp_ota_set_boot_partition(factory);
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG_IMAGE, "Failed to select the provisioning image: %s", esp_err_to_name(err));
+			return;
+		}
+	}
+
+	//the config may change while the other image runs and it cannot update this image's RTC copy
+	app_config_mirror_invalidate();
+	handover_save(HANDOVER_WAKE);
+	ESP_LOGI(TAG_IMAGE, "restarting into the provisioning image");
+	esp_restart();
+}
+
+//from the provisioning image, restart into the sensing image if one is installed, returns if not
+void app_image_restart_into_sensing(void) {
+#if CONFIG_BT_ENABLED
+	const esp_partition_t *sensing = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+	if (sensing == NULL || esp_ota_get_boot_partition() == sensing) {
+		return;
+	}
+
+	esp_app_desc_t app_desc;
+	if (esp_ota_get_partition_description(sensing, &app_desc) != ESP_OK) {
+		ESP_LOGI(TAG_IMAGE, "No sensing image installed, staying on the provisioning image");
+		return;
+	}
+
+	//verifies the image, only runs once after each provisioning session
+	esp_err_t err = esp_ota_set_boot_partition(sensing);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG_IMAGE, "Failed to select the sensing image: %s", esp_err_to_name(err));
+		return;
+	}
+	//as in app_image_restart_into_provisioning, the config may change while the other image runs
+	app_config_mirror_invalidate();
+	//the sample of this wake is taken and its upload tried, the sensing image only goes to deep sleep
+	handover_save(HANDOVER_SLEEP);
+	ESP_LOGI(TAG_IMAGE, "restarting into the sensing image %s", app_desc.version);
+	esp_restart();
+#endif
+}
+
+//size of the running image and the time from the programmed wake to app_main, which includes the bootloader
+void app_image_report(void) {
+	const esp_partition_t *running = esp_ota_get_running_partition();
+	esp_partition_pos_t pos = {
+			.offset = running->address,
+			.size = running->size,
+	};
+	esp_image_metadata_t metadata;
+	if (esp_image_get_metadata(&pos, &metadata) != ESP_OK) {
+		ESP_LOGE(TAG_IMAGE, "Failed to read the image metadata");
+		return;
+	}
+
+	int64_t latency_us = sleep_sched_wake_latency_us();
+	if (latency_us > 0) {
+		ESP_LOGI(TAG_IMAGE, "%s image in %s, %lu bytes, wake to app_main %lld us", APP_IMAGE_NAME,
+				running->label, (unsigned long)metadata.image_len, latency_us);
+	} else {
+		ESP_LOGI(TAG_IMAGE, "%s image in %s, %lu bytes", APP_IMAGE_NAME, running->label, (unsigned long)metadata.image_len);
+	}
+}
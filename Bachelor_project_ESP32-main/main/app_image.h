@@ -0,0 +1,32 @@
+/*
+ * app_image.h
+ *
+ *  The node ships as two app images sharing the same NVS configuration. The provisioning
+ *  image in the factory partition has BLE and BLUFI and can do everything the sensing image
+ *  does. The sensing image in ota_0 is built without Bluetooth (sdkconfig.sensing) and is
+ *  what deep sleep wakes boot once it is installed.
+ */
+
+#ifndef MAIN_APP_IMAGE_H_
+#define MAIN_APP_IMAGE_H_
+
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#define APP_IMAGE_NVS_NAMESPACE "app_image"
+#define APP_IMAGE_NVS_REQUEST_KEY "prov_req"
+#define APP_IMAGE_NVS_HANDOVER_KEY "handover"
+
+#if CONFIG_BT_ENABLED
+#define APP_IMAGE_NAME "provisioning"
+#else
+#define APP_IMAGE_NAME "sensing"
+#endif
+
+bool app_image_restore_state(bool *wake_done);
+bool app_image_provisioning_requested(bool *fallback);
+void app_image_restart_into_provisioning(bool fallback);
+void app_image_restart_into_sensing(void);
+void app_image_report(void);
+
+#endif /* MAIN_APP_IMAGE_H_ */
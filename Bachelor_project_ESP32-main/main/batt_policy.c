@@ -0,0 +1,171 @@
+/*
+ * batt_policy.c
+ *
+ *  The level and a reference point of the state of charge are kept in RTC memory. The
+ *  CRATE register is sampled while the device is awake with the radio on, so it only
+ *  tells charging from discharging, the remaining life is predicted from how fast the
+ *  state of charge fell since the reference point.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+
+#include "batt_policy.h"
+#include "sleep_sched.h"
+#include "sample_buf.h"
+
+#define TAG_BATT "BATT_POLICY"
+
+#define BATT_POLICY_MAGIC 0x42415431
+
+typedef struct {
+	uint32_t magic;
+	uint8_t level;							// batt_policy_level_t decided on the last full wake
+	double ref_soc;							// state of charge at ref_time_s, reset when it clearly rises or on charge
+	int64_t ref_time_s;
+	double crate;							// last charge rate read, %/hr
+	int32_t life_h;							// predicted hours to empty, -1 while unknown
+} batt_policy_state_t;
+
+RTC_DATA_ATTR static batt_policy_state_t policy_state;
+
+//period and upload multipliers per level, the upload cadence grows before the period does
+static const struct {
+	const char *name;
+	uint8_t period_mult;
+	uint8_t upload_mult;
+} policy_levels[BATT_POLICY_COUNT] = {
+		[BATT_POLICY_CHARGING] = { "charging", 1, 0 },	// 0: upload every sample
+		[BATT_POLICY_NORMAL] = { "normal", 1, 1 },
+		[BATT_POLICY_SAVE] = { "save", 1, 2 },
+		[BATT_POLICY_LOW] = { "low", 2, 4 },
+		[BATT_POLICY_CRITICAL] = { "critical", 4, 8 },
+};
+
+static uint32_t base_period = SLEEP_SCHED_DEFAULT_PERIOD_S;
+static uint32_t base_upload = 1;
+static uint32_t max_period = BATT_POLICY_MAX_PERIOD_S;
+
+static int64_t policy_now_s(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec;
+}
+
+static void policy_state_init(void) {
+	if (policy_state.magic != BATT_POLICY_MAGIC || policy_state.level >= BATT_POLICY_COUNT) {
+		policy_state.magic = BATT_POLICY_MAGIC;
+		policy_state.level = BATT_POLICY_NORMAL;
+		policy_state.ref_time_s = 0;
+		policy_state.crate = 0;
+		policy_state.life_h = -1;
+	}
+}
+
+static batt_policy_level_t level_for_soc(double soc) {
+	if (soc < BATT_POLICY_CRITICAL_SOC) {
+		return BATT_POLICY_CRITICAL;
+	} else if (soc < BATT_POLICY_LOW_SOC) {
+		return BATT_POLICY_LOW;
+	} else if (soc < BATT_POLICY_SAVE_SOC) {
+		return BATT_POLICY_SAVE;
+	}
+	return BATT_POLICY_NORMAL;
+}
+
+//hours to empty from the SoC trend, -1 until there is enough history or while it is not falling.
+//The gauge reading jitters by a fraction of a percent, only a charger or a real rise restarts the trend
+static int32_t predict_life_h(double soc, double crate) {
+	int64_t now = policy_now_s();
+
+	if (policy_state.ref_time_s == 0 || now < policy_state.ref_time_s
+			|| soc > policy_state.ref_soc + BATT_POLICY_TREND_RISE || crate >= BATT_POLICY_CHARGING_CRATE) {
+		policy_state.ref_soc = soc;
+		policy_state.ref_time_s = now;
+		return -1;
+	}
+	double hours = (now - policy_state.ref_time_s) / 3600.0;
+	double drop = policy_state.ref_soc - soc;
+	if (hours < BATT_POLICY_MIN_TREND_H || drop <= 0) {
+		return policy_state.life_h;
+	}
+	return (int32_t)(soc * hours / drop);
+}
+
+//the base values and the period cap are the configured ones, 0 when not configured
+void batt_policy_init(uint32_t base_period_s, uint32_t base_upload_every, uint32_t max_period_s) {
+	policy_state_init();
+	base_period = (base_period_s > 0) ? base_period_s : SLEEP_SCHED_DEFAULT_PERIOD_S;
+	base_upload = (base_upload_every > 0) ? base_upload_every : 1;
+	max_period = (max_period_s > 0) ? max_period_s : BATT_POLICY_MAX_PERIOD_S;
+}
+
+//on every full wake with a fuel gauge sample, takes effect from the next deep sleep
+void batt_policy_update(double soc, double crate) {
+	policy_state_init();
+	batt_policy_level_t old_level = policy_state.level;
+	batt_policy_level_t level = level_for_soc(soc);
+
+	policy_state.crate = crate;
+	policy_state.life_h = predict_life_h(soc, crate);
+
+	//leave a level only once the SoC is clearly above its threshold, so a noisy gauge does not flip it every wake
+	if (level < old_level && old_level != BATT_POLICY_CHARGING) {
+		batt_policy_level_t held = level_for_soc(soc - BATT_POLICY_HYSTERESIS);
+		level = (held < old_level) ? held : old_level;
+	}
+	if (policy_state.life_h >= 0 && policy_state.life_h < BATT_POLICY_MIN_LIFE_H && level < BATT_POLICY_CRITICAL) {
+		level++;
+	}
+	if (crate >= BATT_POLICY_CHARGING_CRATE) {
+		level = BATT_POLICY_CHARGING;
+	}
+
+	policy_state.level = level;
+	if (level != old_level) {
+		ESP_LOGI(TAG_BATT, "%s -> %s at %.1f%% / %.2f %%/hr, period %lu s, upload every %lu",
+				policy_levels[old_level].name, policy_levels[level].name, soc, crate,
+				(unsigned long)batt_policy_period_s(), (unsigned long)batt_policy_upload_every());
+	}
+}
+
+uint32_t batt_policy_period_s(void) {
+	uint32_t period = base_period * policy_levels[policy_state.level].period_mult;
+	if (period > max_period) {
+		//never shorter than configured
+		period = (base_period > max_period) ? base_period : max_period;
+	}
+	return period;
+}
+
+uint32_t batt_policy_upload_every(void) {
+	uint32_t upload = base_upload * policy_levels[policy_state.level].upload_mult;
+	if (upload == 0) {
+		upload = 1;
+	} else if (upload > SAMPLE_BUF_LEN) {
+		//the RTC buffer has to hold every sample until the upload
+		upload = SAMPLE_BUF_LEN;
+	}
+	return upload;
+}
+
+//"&batt=level&period=s&upload=n&crate=%/hr&life_h=hours", life_h is -1 while unknown
+size_t batt_policy_format(char *buf, size_t len) {
+	policy_state_init();
+	int written = snprintf(buf, len, "&batt=%s&period=%lu&upload=%lu&crate=%.2f&life_h=%ld",
+			policy_levels[policy_state.level].name, (unsigned long)batt_policy_period_s(),
+			(unsigned long)batt_policy_upload_every(), policy_state.crate, (long)policy_state.life_h);
+	if (written < 0) {
+		buf[0] = '\0';
+		return 0;
+	}
+	return ((size_t)written < len) ? (size_t)written : len - 1;
+}
+
+//level and charge trend, so an image switch does not restart the 6 h trend window
+void *batt_policy_rtc_state(size_t *len) {
+	*len = sizeof(policy_state);
+	return &policy_state;
+}
@@ -0,0 +1,42 @@
+/*
+ * batt_policy.h
+ *
+ *  Battery policy. The state of charge and charge rate from the MAX17048 pick a level that
+ *  scales the configured sample period and upload cadence. Uploads are stretched first,
+ *  the radio costs far more per wake than a sample, the sample period only at lower levels.
+ */
+
+#ifndef MAIN_BATT_POLICY_H_
+#define MAIN_BATT_POLICY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BATT_POLICY_SAVE_SOC 50				// %, below this uploads are stretched
+#define BATT_POLICY_LOW_SOC 25				// %, below this the sample period is stretched as well
+#define BATT_POLICY_CRITICAL_SOC 10			// %
+#define BATT_POLICY_HYSTERESIS 5			// %, above a threshold before a level is left again
+#define BATT_POLICY_CHARGING_CRATE 1.0		// %/hr, at or above this the battery counts as charging
+#define BATT_POLICY_MIN_LIFE_H (14 * 24)	// predicted life below this moves one level down
+#define BATT_POLICY_MIN_TREND_H 6			// SoC history needed before the life is predicted
+#define BATT_POLICY_TREND_RISE 1.0			// %, a rise above the reference SoC by more than this restarts the trend
+#define BATT_POLICY_MAX_PERIOD_S (4 * 3600)	// default cap of the stretched sample period, "maxperiod" overrides it
+#define BATT_POLICY_FORM_LEN 96				// longest form fields batt_policy_format writes
+
+typedef enum {
+	BATT_POLICY_CHARGING,					// upload every sample, the radio is paid for by the charger
+	BATT_POLICY_NORMAL,						// configured period and cadence
+	BATT_POLICY_SAVE,
+	BATT_POLICY_LOW,
+	BATT_POLICY_CRITICAL,
+	BATT_POLICY_COUNT
+} batt_policy_level_t;
+
+void batt_policy_init(uint32_t base_period_s, uint32_t base_upload_every, uint32_t max_period_s);
+void batt_policy_update(double soc, double crate);
+uint32_t batt_policy_period_s(void);
+uint32_t batt_policy_upload_every(void);
+size_t batt_policy_format(char *buf, size_t len);
+void *batt_policy_rtc_state(size_t *len);
+
+#endif /* MAIN_BATT_POLICY_H_ */
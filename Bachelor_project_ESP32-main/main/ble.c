@@ -13,14 +13,33 @@
 #include "esp_log.h"
 #include "esp_blufi.h"
 #include "esp_bt.h"
+#include "esp_system.h"
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BT_BLUEDROID_ENABLED
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
+#endif
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+#endif
 
 
 
 #include "ble.h"
 
+static bool bt_mem_released = false;
+
 
+/* The BLUFI host runs on NimBLE by default, Bluedroid is kept selectable in menuconfig
+   (Component config > Bluetooth > Host) for comparing heap and advertising latency */
+#ifdef CONFIG_BT_BLUEDROID_ENABLED
 esp_err_t esp_blufi_host_init(void)
 {
 	int ret;
@@ -101,6 +120,124 @@ esp_err_t esp_blufi_host_and_cb_init(esp_blufi_callbacks_t *callbacks)
 	return ESP_OK;
 
 }
+#endif /* CONFIG_BT_BLUEDROID_ENABLED */
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+void ble_store_config_init(void);
+
+static void blufi_on_reset(int reason)
+{
+	BLE_ERROR("NimBLE host reset, reason=%d\n", reason);
+}
+
+/* the host and controller are in sync, the profile init reports ESP_BLUFI_EVENT_INIT_FINISH */
+static void blufi_on_sync(void)
+{
+	esp_blufi_profile_init();
+}
+
+static void blufi_host_task(void *param)
+{
+	BLE_INFO("BLE host task started\n");
+	/* returns only when nimble_port_stop is called */
+	nimble_port_run();
+	nimble_port_freertos_deinit();
+}
+
+esp_err_t esp_blufi_host_init(void)
+{
+	esp_err_t ret;
+	int rc;
+
+	ret = esp_nimble_init();
+	if (ret) {
+		BLE_ERROR("%s init nimble failed: %s\n", __func__, esp_err_to_name(ret));
+		return ESP_FAIL;
+	}
+
+	ble_hs_cfg.reset_cb = blufi_on_reset;
+	ble_hs_cfg.sync_cb = blufi_on_sync;
+	ble_hs_cfg.gatts_register_cb = esp_blufi_gatt_svr_register_cb;
+	ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+	ble_hs_cfg.sm_io_cap = BLE_HS_IO_NO_INPUT_OUTPUT;
+
+	rc = esp_blufi_gatt_svr_init();
+	if (rc) {
+		BLE_ERROR("%s blufi gatt server init failed: %d\n", __func__, rc);
+		return ESP_FAIL;
+	}
+
+	rc = ble_svc_gap_device_name_set(BLUFI_DEVICE_NAME);
+	if (rc) {
+		BLE_ERROR("%s set device name failed: %d\n", __func__, rc);
+		return ESP_FAIL;
+	}
+
+	ble_store_config_init();
+
+	esp_blufi_btc_init();
+
+	ret = esp_nimble_enable(blufi_host_task);
+	if (ret) {
+		BLE_ERROR("%s enable nimble failed: %s\n", __func__, esp_err_to_name(ret));
+		return ESP_FAIL;
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t esp_blufi_host_deinit(void)
+{
+	esp_err_t ret = ESP_OK;
+
+	esp_blufi_gatt_svr_deinit();
+	ret = nimble_port_stop();
+	if (ret == ESP_OK) {
+		esp_nimble_deinit();
+	}
+
+	ret = esp_blufi_profile_deinit();
+	if (ret != ESP_OK) {
+		return ret;
+	}
+
+	esp_blufi_btc_deinit();
+
+	return ESP_OK;
+}
+
+/* NimBLE has no separate GAP callback, advertising is handled inside esp_blufi */
+esp_err_t esp_blufi_gap_register_callback(void)
+{
+	return ESP_OK;
+}
+
+/* the callbacks have to be in place before the host syncs and reports INIT_FINISH */
+esp_err_t esp_blufi_host_and_cb_init(esp_blufi_callbacks_t *callbacks)
+{
+	esp_err_t ret = ESP_OK;
+
+	ret = esp_blufi_register_callbacks(callbacks);
+	if (ret) {
+		BLE_ERROR("%s blufi register failed, error code = %x\n", __func__, ret);
+		return ret;
+	}
+
+	ret = esp_blufi_gap_register_callback();
+	if (ret) {
+		BLE_ERROR("%s gap register failed, error code = %x\n", __func__, ret);
+		return ret;
+	}
+
+	ret = esp_blufi_host_init();
+	if (ret) {
+		BLE_ERROR("%s initialise host failed: %s\n", __func__, esp_err_to_name(ret));
+		return ret;
+	}
+
+	return ESP_OK;
+}
+#endif /* CONFIG_BT_NIMBLE_ENABLED */
 
 esp_err_t esp_blufi_controller_init() {
 	esp_err_t ret = ESP_OK;
@@ -136,3 +273,22 @@ esp_err_t esp_blufi_controller_deinit() {
 
 	return ret;
 }
+
+/* give the BT controller and host (NimBLE) memory back to the heap, BT can not be
+   initialised again until the next restart */
+void ble_release_memory(void)
+{
+	size_t free_before = esp_get_free_heap_size();
+	esp_err_t ret = esp_bt_mem_release(ESP_BT_MODE_BLE);
+	if (ret) {
+		BLE_ERROR("%s release bt memory failed: %s\n", __func__, esp_err_to_name(ret));
+		return;
+	}
+	bt_mem_released = true;
+	BLE_INFO("BT memory released, %u bytes returned to the heap\n", esp_get_free_heap_size() - free_before);
+}
+
+bool ble_memory_released(void)
+{
+	return bt_mem_released;
+}
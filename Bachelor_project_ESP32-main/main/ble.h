@@ -12,6 +12,9 @@
 #define BLE_INFO(fmt, ...)   ESP_LOGI(BLE_TAG, fmt, ##__VA_ARGS__)
 #define BLE_ERROR(fmt, ...)  ESP_LOGE(BLE_TAG, fmt, ##__VA_ARGS__)
 
+#define BLUFI_AES_BENCHMARK 0				// 1 logs the AES-CFB128 packet and byte rate on every BLUFI connect
+#define BLUFI_AES_BENCHMARK_PACKETS 1000	// packets encrypted per frame size
+
 void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_data, int *output_len, bool *need_free);
 int blufi_aes_encrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len);
 int blufi_aes_decrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len);
@@ -25,3 +28,6 @@ esp_err_t esp_blufi_host_and_cb_init(esp_blufi_callbacks_t *callbacks);
 esp_err_t esp_blufi_host_deinit(void);
 esp_err_t esp_blufi_controller_init(void);
 esp_err_t esp_blufi_controller_deinit(void);
+
+void ble_release_memory(void);
+bool ble_memory_released(void);
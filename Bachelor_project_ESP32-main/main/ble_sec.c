@@ -22,11 +22,18 @@
 
 #include "esp_blufi_api.h"
 #include "ble.h"
+#include "power_mgmt.h"
 
 #include "mbedtls/aes.h"
 #include "mbedtls/dhm.h"
 #include "mbedtls/md5.h"
+#include "mbedtls/ecdh.h"
+#include "mbedtls/hkdf.h"
+#include "mbedtls/md.h"
 #include "esp_crc.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 /*
    The SEC_TYPE_xxx is for self-defined packet data type in the procedure of "BLUFI negotiate key"
@@ -37,24 +44,33 @@
 #define SEC_TYPE_DH_P           0x02
 #define SEC_TYPE_DH_G           0x03
 #define SEC_TYPE_DH_PUBLIC      0x04
+/* X25519 key agreement with a HKDF-SHA256 derived key. The phone sends its 32 byte public key
+   and gets ours back, clients that do not know this type keep using the DH exchange above */
+#define SEC_TYPE_X25519_PUBLIC  0x05
+
+#define X25519_KEY_LEN          32
+#define BLUFI_HKDF_INFO         "blufi-x25519-aes128"
 
 
 struct blufi_security {
 #define DH_SELF_PUB_KEY_LEN     128
 #define DH_SELF_PUB_KEY_BIT_LEN (DH_SELF_PUB_KEY_LEN * 8)
-	uint8_t  self_public_key[DH_SELF_PUB_KEY_LEN];
+	uint8_t  self_public_key[DH_SELF_PUB_KEY_LEN];		/* DH, or the first X25519_KEY_LEN bytes for X25519 */
 #define SHARE_KEY_LEN           128
 #define SHARE_KEY_BIT_LEN       (SHARE_KEY_LEN * 8)
 	uint8_t  share_key[SHARE_KEY_LEN];
 	size_t   share_len;
 #define PSK_LEN                 16
 	uint8_t  psk[PSK_LEN];
-	uint8_t  *dh_param;
-	int      dh_param_len;
+#define DH_PARAM_MAX_LEN        512				/* P, G and the peer key of a 1024-bit group fit easily */
+	uint8_t  dh_param[DH_PARAM_MAX_LEN];
+	int      dh_param_len;						/* 0 until SEC_TYPE_DH_PARAM_LEN arrived */
 	uint8_t  iv[16];
 	mbedtls_dhm_context dhm;
 	mbedtls_aes_context aes;
 };
+// one connection at a time, so the context lives in static storage and is reused across connections
+static struct blufi_security blufi_sec_storage;
 struct blufi_security *blufi_sec;
 
 int myrand( void *rng_state, unsigned char *output, size_t len )
@@ -65,7 +81,60 @@ int myrand( void *rng_state, unsigned char *output, size_t len )
 
 extern void btc_blufi_report_error(esp_blufi_error_state_t state);
 
-void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_data, int *output_len, bool *need_free)
+/* ephemeral X25519 key pair, shared secret and AES key, the public key is left in self_public_key */
+static int blufi_x25519_negotiate(const uint8_t *peer_public)
+{
+	mbedtls_ecp_group grp;
+	mbedtls_mpi d, z;
+	mbedtls_ecp_point q, peer_q;
+	uint8_t shared[X25519_KEY_LEN];
+	size_t olen;
+	int ret;
+
+	mbedtls_ecp_group_init(&grp);
+	mbedtls_mpi_init(&d);
+	mbedtls_mpi_init(&z);
+	mbedtls_ecp_point_init(&q);
+	mbedtls_ecp_point_init(&peer_q);
+
+	ret = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519);
+	if (ret == 0) {
+		ret = mbedtls_ecdh_gen_public(&grp, &d, &q, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecp_point_write_binary(&grp, &q, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen,
+				blufi_sec->self_public_key, X25519_KEY_LEN);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecp_point_read_binary(&grp, &peer_q, peer_public, X25519_KEY_LEN);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecdh_compute_shared(&grp, &z, &peer_q, &d, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_mpi_write_binary_le(&z, shared, sizeof(shared));
+	}
+	if (ret == 0) {
+		ret = mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), NULL, 0, shared, sizeof(shared),
+				(const uint8_t *)BLUFI_HKDF_INFO, strlen(BLUFI_HKDF_INFO), blufi_sec->psk, PSK_LEN);
+	}
+	if (ret == 0) {
+		ret = mbedtls_aes_setkey_enc(&blufi_sec->aes, blufi_sec->psk, 128);
+	}
+	if (ret) {
+		BLE_ERROR("%s x25519 negotiation failed %d\n", __func__, ret);
+	}
+
+	memset(shared, 0, sizeof(shared));
+	mbedtls_ecp_point_free(&peer_q);
+	mbedtls_ecp_point_free(&q);
+	mbedtls_mpi_free(&z);
+	mbedtls_mpi_free(&d);
+	mbedtls_ecp_group_free(&grp);
+	return ret;
+}
+
+static void blufi_dh_negotiate(uint8_t *data, int len, uint8_t **output_data, int *output_len, bool *need_free)
 {
 	int ret;
 	uint8_t type = data[0];
@@ -79,20 +148,16 @@ void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_da
 	switch (type) {
 	case SEC_TYPE_DH_PARAM_LEN:
 		blufi_sec->dh_param_len = ((data[1]<<8)|data[2]);
-		if (blufi_sec->dh_param) {
-			free(blufi_sec->dh_param);
-			blufi_sec->dh_param = NULL;
-		}
-		blufi_sec->dh_param = (uint8_t *)malloc(blufi_sec->dh_param_len);
-		if (blufi_sec->dh_param == NULL) {
+		if (blufi_sec->dh_param_len > DH_PARAM_MAX_LEN) {
 			btc_blufi_report_error(ESP_BLUFI_DH_MALLOC_ERROR);
-			BLE_ERROR("%s, malloc failed\n", __func__);
+			BLE_ERROR("%s, dh param too long %d\n", __func__, blufi_sec->dh_param_len);
+			blufi_sec->dh_param_len = 0;
 			return;
 		}
 		break;
 	case SEC_TYPE_DH_PARAM_DATA:{
-		if (blufi_sec->dh_param == NULL) {
-			BLE_ERROR("%s, blufi_sec->dh_param == NULL\n", __func__);
+		if (blufi_sec->dh_param_len == 0 || len < blufi_sec->dh_param_len + 1) {
+			BLE_ERROR("%s, dh param length not announced or data short\n", __func__);
 			btc_blufi_report_error(ESP_BLUFI_DH_PARAM_ERROR);
 			return;
 		}
@@ -104,8 +169,7 @@ void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_da
 			btc_blufi_report_error(ESP_BLUFI_READ_PARAM_ERROR);
 			return;
 		}
-		free(blufi_sec->dh_param);
-		blufi_sec->dh_param = NULL;
+		blufi_sec->dh_param_len = 0;
 
 		const int dhm_len = mbedtls_dhm_get_len(&blufi_sec->dhm);
 		ret = mbedtls_dhm_make_public(&blufi_sec->dhm, dhm_len, blufi_sec->self_public_key, dhm_len, myrand, NULL);
@@ -143,6 +207,20 @@ void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_da
 
 	}
 	break;
+	case SEC_TYPE_X25519_PUBLIC:
+		if (len < 1 + X25519_KEY_LEN) {
+			BLE_ERROR("%s, x25519 public key too short %d\n", __func__, len);
+			btc_blufi_report_error(ESP_BLUFI_DH_PARAM_ERROR);
+			return;
+		}
+		if (blufi_x25519_negotiate(&data[1]) != 0) {
+			btc_blufi_report_error(ESP_BLUFI_DH_PARAM_ERROR);
+			return;
+		}
+		*output_data = &blufi_sec->self_public_key[0];
+		*output_len = X25519_KEY_LEN;
+		*need_free = false;
+		break;
 	case SEC_TYPE_DH_P:
 		break;
 	case SEC_TYPE_DH_G:
@@ -152,6 +230,33 @@ void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_da
 	}
 }
 
+/* the DH key exchange is the longest CPU bound step of provisioning, run it at the max clock */
+void blufi_dh_negotiate_data_handler(uint8_t *data, int len, uint8_t **output_data, int *output_len, bool *need_free)
+{
+	uint32_t start_cycles = esp_cpu_get_cycle_count();
+	int64_t start_us = esp_timer_get_time();
+	size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	/* the minimum free size then tracks the lowest point of this call instead of since boot */
+	heap_caps_monitor_local_minimum_free_size_start();
+
+	power_phase_begin(POWER_PHASE_CRYPTO);
+	blufi_dh_negotiate(data, len, output_data, output_len, need_free);
+	power_phase_end(POWER_PHASE_CRYPTO);
+
+	uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+	int64_t elapsed_us = esp_timer_get_time() - start_us;
+	size_t local_min = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+	heap_caps_monitor_local_minimum_free_size_stop();
+	size_t free_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+	/* only the steps that compute a key are worth comparing, held includes the reply BLUFI frees later */
+	if (data != NULL && len > 0 && (data[0] == SEC_TYPE_DH_PARAM_DATA || data[0] == SEC_TYPE_X25519_PUBLIC)) {
+		BLE_INFO("%s handshake: %lu cycles, %lld us, heap %u bytes free before, peak %d, held %d\n",
+				data[0] == SEC_TYPE_X25519_PUBLIC ? "x25519" : "dh1024", (unsigned long)cycles, elapsed_us,
+				(unsigned)free_before, (int)(free_before - local_min), (int)(free_before - free_after));
+	}
+}
+
 int blufi_aes_encrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len)
 {
 	int ret;
@@ -161,7 +266,9 @@ int blufi_aes_encrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len)
 	memcpy(iv0, blufi_sec->iv, sizeof(blufi_sec->iv));
 	iv0[0] = iv8;   /* set iv8 as the iv0[0] */
 
+	power_phase_begin(POWER_PHASE_CRYPTO);
 	ret = mbedtls_aes_crypt_cfb128(&blufi_sec->aes, MBEDTLS_AES_ENCRYPT, crypt_len, &iv_offset, iv0, crypt_data, crypt_data);
+	power_phase_end(POWER_PHASE_CRYPTO);
 	if (ret) {
 		return -1;
 	}
@@ -178,7 +285,9 @@ int blufi_aes_decrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len)
 	memcpy(iv0, blufi_sec->iv, sizeof(blufi_sec->iv));
 	iv0[0] = iv8;   /* set iv8 as the iv0[0] */
 
+	power_phase_begin(POWER_PHASE_CRYPTO);
 	ret = mbedtls_aes_crypt_cfb128(&blufi_sec->aes, MBEDTLS_AES_DECRYPT, crypt_len, &iv_offset, iv0, crypt_data, crypt_data);
+	power_phase_end(POWER_PHASE_CRYPTO);
 	if (ret) {
 		return -1;
 	}
@@ -192,19 +301,50 @@ uint16_t blufi_crc_checksum(uint8_t iv8, uint8_t *data, int len)
 	return esp_crc16_be(0, data, len);
 }
 
-esp_err_t blufi_security_init(void)
+#if BLUFI_AES_BENCHMARK
+// CFB128 throughput on the connection's AES context, the key is a throwaway and replaced by the handshake
+static void blufi_aes_benchmark(void)
 {
-	blufi_sec = (struct blufi_security *)malloc(sizeof(struct blufi_security));
-	if (blufi_sec == NULL) {
-		return ESP_FAIL;
+	static const int frame_sizes[] = { 16, 64, 128, 244 };	/* short commands up to a full frame at the maximum MTU */
+	static uint8_t frame[244];
+
+	memset(blufi_sec->psk, 0x5a, PSK_LEN);
+	mbedtls_aes_setkey_enc(&blufi_sec->aes, blufi_sec->psk, 128);
+
+	for (int i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+		int64_t start_us = esp_timer_get_time();
+		for (int n = 0; n < BLUFI_AES_BENCHMARK_PACKETS; n++) {
+			blufi_aes_encrypt((uint8_t)n, frame, frame_sizes[i]);
+		}
+		int64_t elapsed_us = esp_timer_get_time() - start_us;
+		if (elapsed_us <= 0) {
+			elapsed_us = 1;
+		}
+		BLE_INFO("aes-cfb128 %3d byte frames: %lld packets/s, %lld bytes/s\n", frame_sizes[i],
+				BLUFI_AES_BENCHMARK_PACKETS * 1000000LL / elapsed_us,
+				(int64_t)BLUFI_AES_BENCHMARK_PACKETS * frame_sizes[i] * 1000000LL / elapsed_us);
 	}
 
+	memset(blufi_sec->psk, 0x0, PSK_LEN);
+}
+#endif
+
+esp_err_t blufi_security_init(void)
+{
+	if (blufi_sec != NULL) {
+		// connect without a disconnect in between, release the mbedtls buffers before the memset
+		blufi_security_deinit();
+	}
+	blufi_sec = &blufi_sec_storage;
 	memset(blufi_sec, 0x0, sizeof(struct blufi_security));
 
 	mbedtls_dhm_init(&blufi_sec->dhm);
+	// uses the AES peripheral when CONFIG_MBEDTLS_HARDWARE_AES is set
 	mbedtls_aes_init(&blufi_sec->aes);
 
-	memset(blufi_sec->iv, 0x0, 16);
+#if BLUFI_AES_BENCHMARK
+	blufi_aes_benchmark();
+#endif
 	return 0;
 }
 
@@ -213,15 +353,10 @@ void blufi_security_deinit(void)
 	if (blufi_sec == NULL) {
 		return;
 	}
-	if (blufi_sec->dh_param){
-		free(blufi_sec->dh_param);
-		blufi_sec->dh_param = NULL;
-	}
 	mbedtls_dhm_free(&blufi_sec->dhm);
 	mbedtls_aes_free(&blufi_sec->aes);
 
+	// wipes the session key as well
 	memset(blufi_sec, 0x0, sizeof(struct blufi_security));
-
-	free(blufi_sec);
-	blufi_sec =  NULL;
+	blufi_sec = NULL;
 }
@@ -0,0 +1,103 @@
+/*
+ * blog.c
+ *
+ *  The ring sits in RTC memory that is not initialised at boot, so it survives deep sleep
+ *  and resets after a panic or watchdog. It is cleared when a different firmware boots,
+ *  the format string addresses only match the ELF they were recorded with.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_app_desc.h"
+#include "freertos/FreeRTOS.h"
+
+#include "blog.h"
+
+#define BLOG_MAGIC 0x424C4F47
+
+//little endian on the host: <IIHBB followed by BLOG_MAX_ARGS * I
+typedef struct {
+	uint32_t fmt;							// address of the format string in flash
+	uint32_t time_ms;						// esp_log_timestamp
+	uint16_t wake;							// boot count, wrapping
+	uint8_t level;
+	uint8_t nargs;
+	uint32_t args[BLOG_MAX_ARGS];
+} blog_record_t;
+
+typedef struct {
+	uint32_t magic;
+	uint8_t elf_sha[4];						// first bytes of the app ELF hash the records belong to
+	uint16_t wake;
+	uint16_t head;							// next record to write
+	uint16_t count;
+	uint16_t reserved;
+	blog_record_t records[BLOG_RING_ENTRIES];
+} blog_ring_t;
+
+RTC_NOINIT_ATTR static blog_ring_t ring;
+
+static bool ring_checked = false;
+static portMUX_TYPE ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//once per boot, before the first record
+static void ring_check(void) {
+	const esp_app_desc_t *desc = esp_app_get_description();
+	if (ring.magic != BLOG_MAGIC || memcmp(ring.elf_sha, desc->app_elf_sha256, sizeof(ring.elf_sha)) != 0
+			|| ring.head >= BLOG_RING_ENTRIES || ring.count > BLOG_RING_ENTRIES) {
+		memset(&ring, 0, sizeof(ring));
+		memcpy(ring.elf_sha, desc->app_elf_sha256, sizeof(ring.elf_sha));
+		ring.magic = BLOG_MAGIC;
+	}
+	ring.wake++;
+	ring_checked = true;
+}
+
+void blog_write(esp_log_level_t level, const char *fmt, const uint32_t *args, uint32_t nargs) {
+	uint32_t time_ms = esp_log_timestamp();
+
+	portENTER_CRITICAL_SAFE(&ring_lock);
+	if (!ring_checked) {
+		ring_check();
+	}
+	blog_record_t *record = &ring.records[ring.head];
+	record->fmt = (uint32_t)fmt;
+	record->time_ms = time_ms;
+	record->wake = ring.wake;
+	record->level = level;
+	record->nargs = (nargs > BLOG_MAX_ARGS) ? BLOG_MAX_ARGS : nargs;
+	memcpy(record->args, args, record->nargs * sizeof(uint32_t));
+	ring.head = (ring.head + 1) % BLOG_RING_ENTRIES;
+	if (ring.count < BLOG_RING_ENTRIES) {
+		ring.count++;
+	}
+	portEXIT_CRITICAL_SAFE(&ring_lock);
+}
+
+//"BLOG:<elf sha>:<records>" and one hex line per record oldest first, the ring is empty afterwards
+void blog_flush(void) {
+	blog_record_t records[BLOG_RING_ENTRIES];
+	uint16_t count;
+
+	portENTER_CRITICAL(&ring_lock);
+	if (!ring_checked) {
+		ring_check();
+	}
+	count = ring.count;
+	for (int i = 0; i < count; i++) {
+		records[i] = ring.records[(ring.head + BLOG_RING_ENTRIES - count + i) % BLOG_RING_ENTRIES];
+	}
+	ring.count = 0;
+	portEXIT_CRITICAL(&ring_lock);
+
+	printf("BLOG:%02x%02x%02x%02x:%u\n", ring.elf_sha[0], ring.elf_sha[1], ring.elf_sha[2], ring.elf_sha[3], count);
+	for (int i = 0; i < count; i++) {
+		const uint8_t *bytes = (const uint8_t *)&records[i];
+		printf("BLOG:");
+		for (size_t j = 0; j < sizeof(blog_record_t); j++) {
+			printf("%02x", bytes[j]);
+		}
+		printf("\n");
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ * blog.h
+ *
+ *  Deferred binary log. BLOGx records the address of the format string and up to
+ *  BLOG_MAX_ARGS raw 32 bit arguments in a ring in RTC memory, nothing is formatted or
+ *  written to the UART on the device. blog_flush dumps the ring as hex lines and
+ *  tools/blog_decode.py formats them on the host with the strings from the app ELF.
+ *
+ *  Each source file can set its own compile-time level by defining BLOG_LEVEL before
+ *  including this header, calls above it are not compiled in.
+ */
+
+#ifndef MAIN_BLOG_H_
+#define MAIN_BLOG_H_
+
+#include <stdint.h>
+#include "esp_log.h"
+
+#define BLOG_RING_ENTRIES 32				// records kept, the oldest are overwritten
+#define BLOG_MAX_ARGS 4						// 32 bit arguments per record, floats are stored as float
+#define BLOG_ECHO 0							// 1 also prints every record with ESP_LOG, for bench debugging
+
+#ifndef BLOG_LEVEL
+#define BLOG_LEVEL ESP_LOG_INFO
+#endif
+
+void blog_write(esp_log_level_t level, const char *fmt, const uint32_t *args, uint32_t nargs);
+void blog_flush(void);
+
+//arguments are integers of at most 32 bits or floating point, strings and 64 bit values cannot be decoded
+static inline uint32_t blog_arg_float(double value) {
+	union { float f; uint32_t u; } arg = { .f = (float)value };
+	return arg.u;
+}
+
+static inline uint32_t blog_arg_int(uint32_t value) {
+	return value;
+}
+
+#define BLOG_ARG(x) _Generic((x), float: blog_arg_float, double: blog_arg_float, default: blog_arg_int)(x)
+
+#define BLOG_NARGS(...) BLOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define BLOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+#define BLOG_ARGS_0()
+#define BLOG_ARGS_1(a) BLOG_ARG(a)
+#define BLOG_ARGS_2(a, b) BLOG_ARG(a), BLOG_ARG(b)
+#define BLOG_ARGS_3(a, b, c) BLOG_ARG(a), BLOG_ARG(b), BLOG_ARG(c)
+#define BLOG_ARGS_4(a, b, c, d) BLOG_ARG(a), BLOG_ARG(b), BLOG_ARG(c), BLOG_ARG(d)
+#define BLOG_CAT(a, b) BLOG_CAT_(a, b)
+#define BLOG_CAT_(a, b) a##b
+
+#if BLOG_ECHO
+#define BLOG_ECHO_LOG(level, tag, fmt, ...) ESP_LOG_LEVEL(level, tag, fmt, ##__VA_ARGS__)
+#else
+#define BLOG_ECHO_LOG(level, tag, fmt, ...)
+#endif
+
+//tag has to be a string literal, it is stored with the format string
+#define BLOG(level, tag, fmt, ...) do { \
+		if ((level) <= BLOG_LEVEL) { \
+			const uint32_t blog_args[] = { 0, BLOG_CAT(BLOG_ARGS_, BLOG_NARGS(__VA_ARGS__))(__VA_ARGS__) }; \
+			blog_write((level), tag ": " fmt, &blog_args[1], BLOG_NARGS(__VA_ARGS__)); \
+			BLOG_ECHO_LOG(level, tag, fmt, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define BLOGE(tag, fmt, ...) BLOG(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define BLOGW(tag, fmt, ...) BLOG(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define BLOGI(tag, fmt, ...) BLOG(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define BLOGD(tag, fmt, ...) BLOG(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+
+#endif /* MAIN_BLOG_H_ */
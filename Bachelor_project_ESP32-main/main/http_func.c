@@ -9,18 +9,70 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "esp_log.h"
+#define BLOG_LEVEL ESP_LOG_INFO
+#include "blog.h"
 #include "esp_http_client.h"
 #include "wifi.h"
+#include "http_func.h"
+#include "uplink.h"
+#include "sample_buf.h"
+#include "power_mgmt.h"
+#include "app_config.h"
+#include "mem_stats.h"
+#include "wake_prof.h"
+#include "wake_guard.h"
+#include "batt_policy.h"
 
 #define SERVER_URL_FORMAT "http://%s"
-#define SERVER_URL_BUFFER_SIZE (strlen(SERVER_URL_FORMAT) + 256)
+#define SERVER_URL_BUFFER_SIZE (strlen(SERVER_URL_FORMAT) + sizeof(app_config.uri))
 
 #define TAG_HTTP "HTTP_POST"
 
-esp_err_t send_data_http(char *device_name, double temperature, double humidity, double charge){
+#define POST_SAMPLE_LEN 320
+
+// encoded form body, filled by prepare_data_http while the radio is still associating
+static char post_data[POST_SAMPLE_LEN + MEM_STATS_FORM_LEN + WAKE_PROF_FORM_LEN + WAKE_GUARD_FORM_LEN + BATT_POLICY_FORM_LEN];
+static bool post_data_ready = false;
+
+// the current sample also carries the memory telemetry, wake profile, overrun counts and battery policy, buffered samples do not
+void prepare_data_http(char *device_name, double temperature, double humidity, double charge){
+    int len = snprintf(post_data, POST_SAMPLE_LEN, "device_name=%s&temperature=%.2f&humidity=%.3f&charge=%.2f", device_name, temperature, humidity, charge);
+    if (len >= POST_SAMPLE_LEN) {
+        len = POST_SAMPLE_LEN - 1;
+    }
+    len += mem_stats_format(post_data + len, MEM_STATS_FORM_LEN);
+    len += wake_prof_format(post_data + len, WAKE_PROF_FORM_LEN);
+    len += wake_guard_format(post_data + len, WAKE_GUARD_FORM_LEN);
+    batt_policy_format(post_data + len, sizeof(post_data) - len);
+    post_data_ready = true;
+}
+
+bool is_data_http_prepared(void){
+    return post_data_ready;
+}
+
+void clear_data_http(void){
+    post_data_ready = false;
+}
+
+// the request reached the server, the sample must not be sent again
+bool http_err_delivered(esp_err_t err){
+    return err == ESP_ERR_INVALID_RESPONSE || err == ESP_ERR_TIMEOUT;
+}
+
+static esp_err_t post_form_request(const char *body){
+    // fast path over the connection the uplink warm-up opened when the IP arrived
+    esp_err_t err = uplink_post(body, strlen(body), UPLINK_WARMUP_TIMEOUT_MS / portTICK_PERIOD_MS);
+    if (err == ESP_OK || http_err_delivered(err)) {
+        // posting it again would duplicate the sample
+        return err;
+    }
+    ESP_LOGW(TAG_HTTP, "No warm connection, falling back to esp_http_client");
+
     char SERVER_URL[SERVER_URL_BUFFER_SIZE];
-    sprintf(SERVER_URL, SERVER_URL_FORMAT, uri);
+    sprintf(SERVER_URL, SERVER_URL_FORMAT, app_config.uri);
 
     esp_http_client_config_t config = {
             .url = SERVER_URL,
@@ -31,24 +83,81 @@ esp_err_t send_data_http(char *device_name, double temperature, double humidity,
         return ESP_FAIL;
     }
 
-    char post_data[100];
-    snprintf(post_data, sizeof(post_data), "device_name=%s&temperature=%.2f&humidity=%.3f&charge=%.2f", device_name, temperature, humidity, charge);
-
     esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_post_field(client, post_data, strlen(post_data));
+    esp_http_client_set_post_field(client, body, strlen(body));
 
-    esp_err_t err = esp_http_client_perform(client);
+    err = esp_http_client_perform(client);
     if (err != ESP_OK) {
         ESP_LOGE(TAG_HTTP, "HTTP request failed: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
+    }
+
+    // Cleanup the client handle
+    esp_http_client_cleanup(client);
+
+    return err;
+}
+
+// the request is built and parsed at the max CPU clock, the clock may drop while waiting on the socket
+static esp_err_t post_form(const char *body){
+    power_phase_begin(POWER_PHASE_HTTP);
+    esp_err_t err = post_form_request(body);
+    power_phase_end(POWER_PHASE_HTTP);
+    return err;
+}
+
+esp_err_t send_data_http(void){
+    if (!post_data_ready) {
+        ESP_LOGE(TAG_HTTP, "No payload prepared");
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = post_form(post_data);
+    if (err != ESP_OK) {
+        if (http_err_delivered(err)) {
+            post_data_ready = false;
+        }
         return err;
     }
 
     // If we reach this point, the request was successful
-    ESP_LOGI(TAG_HTTP, "HTTP post successful");
+    BLOGI(TAG_HTTP, "HTTP post successful");
+    post_data_ready = false;
 
-    // Cleanup the client handle
-    esp_http_client_cleanup(client);
+    return ESP_OK;
+}
+
+// post the samples buffered in RTC memory oldest first, with their age in seconds
+esp_err_t send_buffered_data_http(char *device_name){
+    char body[POST_SAMPLE_LEN + 24];
+    rtc_sample_t sample;
+    size_t sent = 0;
+    uint32_t now = (uint32_t)time(NULL);
 
+    while (sample_buf_peek(0, &sample)) {
+        if (sample.flags & SAMPLE_FLAG_RAW) {
+            // not compensated yet, the BME280 calibration was not available on this wake
+            break;
+        }
+        double charge = (sample.soc == SAMPLE_SOC_UNKNOWN) ? -1.0 : sample.soc / 100.0;
+        snprintf(body, sizeof(body), "device_name=%s&temperature=%.2f&humidity=%.3f&charge=%.2f&age=%lu",
+                device_name, sample.temp / 100.0, sample.hum / 100.0, charge, (unsigned long)(now - sample.time_s));
+
+        esp_err_t err = post_form(body);
+        if (err != ESP_OK && !http_err_delivered(err)) {
+            ESP_LOGE(TAG_HTTP, "%u buffered samples sent, %u kept for the next upload", sent, sample_buf_count());
+            return err;
+        }
+        sample_buf_drop(1);
+        sent++;
+    }
+
+    if (sent > 0) {
+        BLOGI(TAG_HTTP, "%u buffered samples sent", sent);
+    }
     return ESP_OK;
 }
+
+// close the keep-alive connection once everything is sent
+void finish_data_http(void){
+    uplink_close();
+}
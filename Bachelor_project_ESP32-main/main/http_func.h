@@ -8,8 +8,15 @@
 #ifndef MAIN_HTTP_FUNC_H_
 #define MAIN_HTTP_FUNC_H_
 
+#include <stdbool.h>
+#include "esp_err.h"
 
-
-esp_err_t  send_data_http(char *device_name, double temperature, double humidity, double charge);
+void prepare_data_http(char *device_name, double temperature, double humidity, double charge);
+bool is_data_http_prepared(void);
+void clear_data_http(void);
+esp_err_t  send_data_http(void);
+esp_err_t send_buffered_data_http(char *device_name);
+void finish_data_http(void);
+bool http_err_delivered(esp_err_t err);
 
 #endif /* MAIN_HTTP_FUNC_H_ */
@@ -14,18 +14,17 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "nvs_flash.h"
-#include "esp_bt.h"
 #include "esp_sleep.h"
 #include "driver/gpio.h"
 #include "driver/i2c.h"
 #include "esp_err.h"
 #include "hal/gpio_types.h"
 #include "hal/i2c_types.h"
+#include "hal/gpio_ll.h"
 
 #include "esp_timer.h"
-#include "esp_blufi_api.h"
-#include "esp_blufi.h"
 #include "esp_wifi.h"
 #include "esp_wifi_types.h"
 
@@ -33,13 +32,31 @@
 #include "sdkconfig.h"
 
 //private includes
+#if CONFIG_BT_ENABLED
+#include "esp_bt.h"
+#include "esp_blufi_api.h"
+#include "esp_blufi.h"
 #include "ble.h"							// Header file for the BLE and BluFi functions
+#endif
 #include "wifi.h"							// Header file for the BluFi and wifi functions
 #include "sensor_func.h"					// Header file for the BME280 measurment function
 #include "bme280.h" 						// Header file for the BME280 component library
 #include "http_func.h" 						// Header file for the HTTP post function
-#include "running_led.h" 					// Header file for the running led thread
+#include "running_led.h" 					// Header file for the status led patterns
 #include "max.h" 							// Header file for the MAX17048 sensor
+#include "sleep_sched.h" 					// Header file for the deep sleep scheduler
+#include "sample_buf.h" 					// Header file for the RTC sample buffer
+#include "power_mgmt.h" 					// Header file for frequency scaling and light sleep
+#include "uplink.h" 						// Header file for the connection to the upload server
+#include "app_fsm.h" 						// Header file for the application state machine
+#include "app_image.h" 						// Header file for switching between the sensing and provisioning images
+#include "app_config.h" 						// Header file for the configuration blob in NVS
+#include "mem_stats.h" 						// Header file for the stack and heap telemetry
+#include "wake_prof.h" 						// Header file for the wake cycle profiler
+#include "wake_guard.h" 					// Header file for the wake deadline supervisor
+#include "batt_policy.h" 					// Header file for the battery aware cadence
+#define BLOG_LEVEL ESP_LOG_INFO				// level of the BLOG calls below
+#include "blog.h" 							// Header file for the deferred binary log
 
 
 
@@ -55,77 +72,71 @@
 #define MAIN_TAG "MAIN_TAG"
 
 //Sleep timer defines
-#define DEEP_SLEEP_CONVERT 1000000
 #define TIMEOUTPERIOD 20000 					// equeal to 20 seconds
+#define CANCEL_WINDOW_MS 5000					// time after boot the button can cancel deep sleep
 
+//Wake pipeline timeouts, sensors and WiFi are started together and waited on in parallel
+#define SENSOR_READY_TIMEOUT 3000				// time to wait for the first BME280 and MAX17048 sample
+#define WIFI_CONNECT_TIMEOUT 10000				// time to wait for IP_EVENT_STA_GOT_IP
 
-//adjust as needed, the BME280 sensor will also get some temprature data from its own heat and the heat of the PCB
-#define TEMPCALIBRATION 3
-
-uint32_t DEEP_SLEEP_PERIOD;
-
+//Button debounce, edges closer than this to the last accepted press are contact bounce
+#define BUTTON_DEBOUNCE_US 200000
 
-//Boolean variables
-volatile bool button_pressed = false; 			// to prevent changing states when application starts
-volatile bool switch_case = false; 				// false for WiFi, true for BLE
-volatile bool should_enter_deep_sleep = true; 	//if false wont enter deep sleep
-volatile bool timeout = false;					// if false the device will not have a time out  when in BLE mode
+//Continuous mode for mains powered nodes, enabled by a non zero "continuous" period in seconds
+#define CONTINUOUS_LISTEN_INTERVAL 3			// beacons between radio wakeups in modem sleep
 
-//handle for switching between BLE mode and WiFi mode
-TaskHandle_t switch_mode_task_handle;
+//Test hook, 1 logs the free heap change over the sensing and sleep preparation of a sample-only wake.
+//The radio never starts on those wakes, so WiFi and lwIP do not allocate in the background. Project
+//objects and tasks use static storage, a difference that repeats on every wake is a leak on this path.
+#define HEAP_CHECK 0
 
-void switch_mode() {
-	switch_case = !switch_case; 				// Toggle the mode
 
-	if (switch_case) {
-		should_enter_deep_sleep = false;
-		stop_bme280();
-		stop_max();
-		blufi_func();
-		vTaskDelay(10 / portTICK_PERIOD_MS); 	//small delay to ensure Blufi get enabled
-		printf("Switched to BLE mode\n");
-		stop_led_task();
-		vTaskDelay(100/portTICK_PERIOD_MS);		// stop, delay and start to ensure the running led thread isnt doubly initialized.
-		start_led_task(100);
+//adjust as needed, the BME280 sensor will also get some temprature data from its own heat and the heat of the PCB
+#define TEMPCALIBRATION 3
 
-	} else {
+//esp_timer timestamps of the wake pipeline, used for the overlap breakdown
+int64_t wake_start_us;
+int64_t wifi_start_us;
+int64_t payload_ready_us;
 
-		should_enter_deep_sleep = true;
-		ble_deinit();							// Disable Bluetooth to save power
-		vTaskDelay(10 / portTICK_PERIOD_MS); 	// small delay to ensure blufi gets disabled
+//sample period in continuous mode, 0 for the deep sleep cycle
+uint32_t continuous_period_s = 0;
+volatile bool continuous_active = false;			// read by button_callback
 
-		//check for internet connection
-		if (is_wifi_connected()) {
-			ESP_LOGI("WiFi", "ESP32 is connected to WiFi");
-		} else {
-			ESP_LOGE("WiFi", "ESP32 is not connected to WiFi");
-		}
-		printf("Switched to WiFi mode\n");
+#if HEAP_CHECK
+//free 8-bit heap before the sensors started on a sample-only wake, 0 on other wakes
+size_t heap_check_free = 0;
+#endif
 
-		stop_led_task();
-		vTaskDelay(100/portTICK_PERIOD_MS); 	// stop, delay and start to ensure the running led thread isnt doubly initialized.
-		start_led_task(100);
 
+//Wake flags, set at boot and by the state handlers
+bool upload_wake = true;						// false on sample-only wakes, the radio is never started
+bool provision_timeout = false;					// BLE mode entered after a failed WiFi connection falls back after TIMEOUTPERIOD
+bool provisioning_boot = false;					// restarted into BLE mode, the BT memory was kept
+bool handover_sleep = false;					// restarted into this image after the other one finished the wake
+bool sensing = false;							// sensor readers started and not all of them have a sample yet
+uint32_t sensors_ready = 0;						// APP_SENSOR_* bits that have a sample since the readers started
 
 
-	}
-}
+//callback for button interrupt, posts straight to the state machine queue
+void IRAM_ATTR button_callback(void* arg) {
+	static int64_t last_press_us = 0;
 
-void switch_mode_task(void *pvParameters) {
-	while(1) {
-		if (button_pressed) {
-			switch_mode(); 						// Handle mode switching
-			button_pressed = false; 			// Reset button flag
+	if (continuous_active) {
+		//level interrupt for the light sleep wakeup, armed for the release while held so it does not fire continuously
+		bool pressed = gpio_ll_get_level(&GPIO, BLE_BUTTON) == 0;
+		gpio_ll_set_intr_type(&GPIO, BLE_BUTTON, pressed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+		if (!pressed) {
+			return;
 		}
-		vTaskDelay(100 / portTICK_PERIOD_MS); 	//delay to prevent de-bounce
 	}
-	vTaskDelete(NULL);
-}
 
-
-//callback for button interrupt
-void button_callback(void* arg) {
-	button_pressed = true;
+	int64_t now = esp_timer_get_time();
+	if (now - last_press_us < BUTTON_DEBOUNCE_US) {
+		return;
+	}
+	last_press_us = now;
+	app_fsm_post_from_isr(APP_EVENT_BUTTON, 0);
 }
 
 //i2c master bus init
@@ -143,108 +154,445 @@ void i2c_master_init(void)
 	i2c_driver_install(I2C_NUM_0, I2C_MODE_MASTER, 0, 0, 0);
 }
 
-//main application
-void app_main(void) {
-	//create button thread for changing which mode we are operating in
-	xTaskCreate(&switch_mode_task, "Switch Mode Task", 4096, NULL, configMAX_PRIORITIES - 1, &switch_mode_task_handle);
+//start both sensor reader tasks, each posts APP_EVENT_SENSOR_READY with its first sample
+void start_sensors(void) {
+	sensors_ready = 0;
+	sensing = true;
+	power_phase_begin(POWER_PHASE_SENSOR);
+	wake_prof_begin(WAKE_PROF_BME280);
+	wake_prof_begin(WAKE_PROF_MAX17048);
 
-	run_led_init();
+	//temp and hum measurment found in bme280.c
+	bme280_sensor_func();
 
-	i2c_master_init();
+	//battery monitor found in max.c
+	max_main();
 
-	gpio_config_t io_conf;
-	io_conf.intr_type = GPIO_INTR_NEGEDGE;
-	io_conf.pin_bit_mask = (1ULL << BLE_BUTTON);
-	io_conf.mode = GPIO_MODE_INPUT;
-	io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
-	gpio_config(&io_conf);
-	gpio_install_isr_service(0);
-	gpio_isr_handler_add(BLE_BUTTON, button_callback, NULL);
+	app_fsm_start_timer(APP_EVENT_SENSOR_TIMEOUT, SENSOR_READY_TIMEOUT, false);
+}
+
+//all readers have a sample or the timeout hit, returns false if a reader had none
+bool finish_sensing(void) {
+	sensing = false;
+	app_fsm_stop_timer(APP_EVENT_SENSOR_TIMEOUT);
+	power_phase_end(POWER_PHASE_SENSOR);
+	//a reader without a sample must not keep the wake guard waiting on its phase
+	wake_prof_cancel(WAKE_PROF_BME280);
+	wake_prof_cancel(WAKE_PROF_MAX17048);
+
+	if (sensors_ready != (APP_SENSOR_BME280 | APP_SENSOR_MAX17048)) {
+		ESP_LOGE(MAIN_TAG, "sensor sample timeout, bme280:%d max17048:%d",
+				(sensors_ready & APP_SENSOR_BME280) != 0, (sensors_ready & APP_SENSOR_MAX17048) != 0);
+		return false;
+	}
+	return true;
+}
+
+void stop_sensors(void) {
+	if (sensing) {
+		finish_sensing();
+	}
+	stop_bme280();
+	stop_max();
+}
+
+//mains powered nodes never reboot, WiFi stays associated in modem sleep and the CPU light sleeps between samples
+void continuous_mode_start(void) {
+	//samples are taken one at a time in sleep_period, the readers would keep the CPU out of light sleep
+	stop_sensors();
+	if (continuous_active) {
+		return;
+	}
+	wake_guard_stop();
+	//the button has to wake the CPU from automatic light sleep, button_callback handles the level interrupt from here on
+	continuous_active = true;
+	gpio_wakeup_enable(BLE_BUTTON, GPIO_INTR_LOW_LEVEL);
+	esp_sleep_enable_gpio_wakeup();
+	power_enable_light_sleep();
+	wifi_enable_modem_sleep(CONTINUOUS_LISTEN_INTERVAL);
+	uplink_set_persistent(true);
+	app_fsm_start_timer(APP_EVENT_PERIOD, continuous_period_s * 1000, true);
+	ESP_LOGI(MAIN_TAG, "continuous mode, sampling every %lu s", (unsigned long)continuous_period_s);
+}
 
-	//init for Wifi
-	wifi_on();
+//runs on the esp_timer task when the wake guard cuts a wake off, the main task may be stuck anywhere,
+//even holding the flash, so only RTC bookkeeping here. The image switch waits for a normal sleep.
+void wake_overrun_rescue(void) {
+	if (is_data_http_prepared()) {
+		//the sample was not confirmed by the server, it goes out with the next upload, sample_buf.c takes the lock
+		sample_buf_push(temp-TEMPCALIBRATION, hum, soc);
+		clear_data_http();
+	}
+}
 
-	vTaskDelay(100 / portTICK_PERIOD_MS);
+//log where the wake time went and how much of the sensor phase was hidden behind WiFi association
+void log_wake_pipeline(int64_t upload_done_us) {
+	int64_t got_ip_us = wifi_got_ip_time_us;
+	int64_t sensor_ms = (payload_ready_us - wake_start_us) / 1000;
+	int64_t wifi_ms = got_ip_us ? (got_ip_us - wifi_start_us) / 1000 : -1;
+	int64_t overlap_ms = 0;
+	if (got_ip_us) {
+		int64_t overlap_end = (payload_ready_us < got_ip_us) ? payload_ready_us : got_ip_us;
+		overlap_ms = (overlap_end - wifi_start_us) / 1000;
+	}
 
+	ESP_LOGI(MAIN_TAG, "wake pipeline: payload ready %lld ms, got IP %lld ms, upload done %lld ms after boot",
+			sensor_ms, got_ip_us ? (got_ip_us - wake_start_us) / 1000 : -1, (upload_done_us - wake_start_us) / 1000);
+	ESP_LOGI(MAIN_TAG, "wake pipeline: sensors %lld ms, wifi association %lld ms, overlapped %lld ms",
+			sensor_ms, wifi_ms, overlap_ms);
+}
 
+//State entry actions
 
-	//check if wifi is connected
-	if (is_wifi_connected()) {
-		ESP_LOGI("WiFi", "ESP32 is connected to WiFi");
-	} else{
-		//enter BLE mode if not connected
-		ESP_LOGI("WiFi", "ESP32 is not connected to WiFi");
-		ESP_LOGI("WiFi", "Device might not have correct WiFi Credentials \n");
-		timeout = true;
-		button_pressed = true;
-	}
-
-	printf("You have 5 seconds to cancel deepsleep\n");
-	vTaskDelay(5000 / portTICK_PERIOD_MS);
-
-
-	while (1) {
-		if (switch_case) {
-			// BLE mode
-			vTaskDelay(100 / portTICK_PERIOD_MS);
-			int timeout_counter = 0;
-			if (timeout==true){
-				while (timeout_counter < TIMEOUTPERIOD) {
-					vTaskDelay( TIMEOUTPERIOD / portTICK_PERIOD_MS);
-					timeout_counter = TIMEOUTPERIOD;
-					vTaskDelay(10/portTICK_PERIOD_MS);
-					break;
-				}
-
-				button_pressed = true; // Trigger mode switch as if button was pressed
-
-				vTaskDelay(10 / portTICK_PERIOD_MS); // Small delay after mode switch
-			}
+//SENSE: sensors sample while WiFi associates, sample-only wakes never start the radio
+void sense_enter(const app_event_t *event) {
+	//blink running led once a second to indicate wifi mode, function found in running_led.c
+	led_set_pattern(&LED_PATTERN_BLINK_500);
+
+#if HEAP_CHECK
+	heap_check_free = upload_wake ? 0 : heap_caps_get_free_size(MALLOC_CAP_8BIT);
+#endif
+	start_sensors();
+
+	if (upload_wake) {
+		//init for Wifi, association continues in the background
+		if (wifi_start_us == 0) {
+			wifi_start_us = esp_timer_get_time();
+			wake_prof_begin(WAKE_PROF_WIFI);
+		}
+		wifi_on();
+		if (wifi_has_ip()) {
+			//connected during provisioning, GOT_IP came before this state
+			wake_prof_cancel(WAKE_PROF_WIFI);
 		} else {
-			// WiFi mode
-			if (should_enter_deep_sleep==true) {
+			app_fsm_start_timer(APP_EVENT_WIFI_TIMEOUT, WIFI_CONNECT_TIMEOUT, false);
+		}
+	}
+}
+
+//UPLINK: buffered samples go first over the same connection, then the current one, function found in http_func.c
+void uplink_enter(const app_event_t *event) {
+	led_set_pattern(&LED_PATTERN_BLINK_500);
+
+	//wake stub samples are raw ADC values, the BME280 calibration is loaded now
+	sample_buf_compensate(TEMPCALIBRATION);
+
+	wake_prof_begin(WAKE_PROF_HTTP);
+	esp_err_t buffered_err = send_buffered_data_http(app_config.name);
+	esp_err_t current_err = send_data_http();
+	wake_prof_end(WAKE_PROF_HTTP);
+	if (continuous_period_s == 0) {
+		finish_data_http();
+	}
+	if (current_err != ESP_OK && !http_err_delivered(current_err)) {
+		//keep the sample for the next upload wake
+		sample_buf_push(temp-TEMPCALIBRATION, hum, soc);
+		clear_data_http();
+	}
+	sleep_sched_upload_done(buffered_err == ESP_OK && current_err == ESP_OK);
+	if (!continuous_active) {
+		log_wake_pipeline(esp_timer_get_time());
+		power_report();
+	}
+
+	//LOG message for what is sendt to the server, the device name is logged before deep sleep
+	BLOGI(MAIN_TAG, "%.2f / %.3f / %.2f", temp-TEMPCALIBRATION, hum, soc);
+
+	app_fsm_post(APP_EVENT_UPLOAD_DONE, 0);
+}
+
+//PROVISION: BLUFI needs the WiFi driver, it does not connect until the phone asks or we return to WiFi mode
+void provision_enter(const app_event_t *event) {
+	//provisioning waits on the user, it has its own timeout
+	wake_guard_stop();
+	//the user is at the device, dump the binary log for tools/blog_decode.py
+	blog_flush();
+	app_fsm_stop_timer(APP_EVENT_WIFI_TIMEOUT);
+	app_fsm_stop_timer(APP_EVENT_CANCEL_WINDOW);
+
+#if CONFIG_BT_ENABLED
+	//the BT memory went back to the heap at boot, BLUFI can only start after a restart
+	if (ble_memory_released()) {
+		app_image_restart_into_provisioning(provision_timeout);
+	}
+
+	wifi_driver_on();
+	stop_sensors();
+	clear_data_http();							// sample again when we return to WiFi mode
+	blufi_func();
+#else
+	//the sensing image has no Bluetooth, restart into the provisioning image
+	app_image_restart_into_provisioning(provision_timeout);
+	ESP_LOGE(MAIN_TAG, "provisioning image not available");
+	return;
+#endif
+	ESP_LOGI(MAIN_TAG, "Switched to BLE mode");
+	led_set_pattern(&LED_PATTERN_BLINK_100);
+
+	if (provision_timeout) {
+		app_fsm_start_timer(APP_EVENT_PROVISION_TIMEOUT, TIMEOUTPERIOD, false);
+	}
+}
+
+//SLEEP: deep sleep until the next aligned wake slot, or light sleep until the next period in continuous mode
+void sleep_enter(const app_event_t *event) {
+	led_set_pattern(&LED_PATTERN_OFF);
+	wake_prof_begin(WAKE_PROF_SLEEP);
+
+	if (continuous_period_s > 0) {
+		continuous_mode_start();
+		return;
+	}
+
+	//LOG message for how the device is configured
+	ESP_LOGI(MAIN_TAG, "name is:%s / uri:%s / timer for deepsleep is:%lu / upload every:%lu", app_config.name, app_config.uri,
+			(unsigned long)app_config.timer_min, (unsigned long)app_config.upload_every);
+
+	//the readers report their stack headroom when stopped, with the heap low point it goes out with the next payload
+	stop_sensors();
+	mem_stats_sample();
+#if HEAP_CHECK
+	if (heap_check_free != 0) {
+		ESP_LOGI(MAIN_TAG, "heap check: %d bytes taken over the sample-only wake",
+				(int)heap_check_free - (int)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+	}
+#endif
+
+	//after provisioning the small sensing image takes over with a restart instead of this sleep, function found in app_image.c
+	app_image_restart_into_sensing();
+
+	//a battery level change on this wake applies from this sleep on
+	sleep_sched_set_cadence(batt_policy_period_s(), batt_policy_upload_every());
+
+	vTaskDelay(10/portTICK_PERIOD_MS);
+
+	// function found in sleep_sched.c
+	sleep_sched_enter_deep_sleep();
+}
 
-				//blink running led twice a second to indicate wifi mode, function found in running_sensor.c
-				start_led_task(500);
 
+//Transition handlers
 
+app_state_t boot_start(const app_event_t *event) {
+	if (handover_sleep) {
+		return APP_STATE_SLEEP;
+	}
+	return provisioning_boot ? APP_STATE_PROVISION : APP_STATE_SENSE;
+}
 
-				//temp and hum measurment found in bme280.c
-				bme280_sensor_func();
+//the user asked for BLE mode, it stays until the button is pressed again
+app_state_t go_provision(const app_event_t *event) {
+	provision_timeout = false;
+	return APP_STATE_PROVISION;
+}
 
-				//battery monitor found in max.c
-				max_main();
+app_state_t go_sleep(const app_event_t *event) {
+	return APP_STATE_SLEEP;
+}
 
-				//delay to ensure sensors are able to measure before moving on
-				vTaskDelay(500 / portTICK_PERIOD_MS);
+//a reader has its first sample, or the sensor timeout hit
+app_state_t sense_sample(const app_event_t *event) {
+	if (!sensing) {
+		return APP_STATE_SENSE;
+	}
+	if (event->type == APP_EVENT_SENSOR_READY) {
+		wake_prof_end_at((event->arg & APP_SENSOR_BME280) ? WAKE_PROF_BME280 : WAKE_PROF_MAX17048, event->time_us);
+		sensors_ready |= event->arg;
+		if (sensors_ready != (APP_SENSOR_BME280 | APP_SENSOR_MAX17048)) {
+			return APP_STATE_SENSE;
+		}
+	}
+	bool complete = finish_sensing();
+	if (sensors_ready & APP_SENSOR_MAX17048) {
+		batt_policy_update(soc, crate);
+	}
 
-				//send name of device, temperature, humidity and state of charge to our webserver function found in http_func.c
-				send_data_http(name, temp-TEMPCALIBRATION, hum, soc);
+	//sample-only wake, keep the reading in RTC memory until the next upload
+	if (!upload_wake) {
+		if (complete) {
+			sample_buf_push(temp-TEMPCALIBRATION, hum, soc);
+			BLOGI(MAIN_TAG, "buffered %.2f / %.3f / %.2f, %u samples in buffer", temp-TEMPCALIBRATION, hum, soc, sample_buf_count());
+		}
+		return APP_STATE_SLEEP;
+	}
 
-				//LOG message for what is sendt to the server
-				ESP_LOGI(MAIN_TAG, "%s / %.2f / %.3f / %.2f", name, temp-TEMPCALIBRATION, hum, soc);
+	//encode the payload while waiting for the IP, so the upload can start as soon as it arrives
+	mem_stats_sample();
+	prepare_data_http(app_config.name, temp-TEMPCALIBRATION, hum, soc);
+	payload_ready_us = esp_timer_get_time();
 
-				//LOG message for how the device is configured
-				ESP_LOGI(MAIN_TAG, "name is:%s / uri:%s / timer for deepsleep is:%s", name, uri, timer);
+	return wifi_has_ip() ? APP_STATE_UPLINK : APP_STATE_SENSE;
+}
 
-				int timer_value = atoi(timer);
+app_state_t sense_got_ip(const app_event_t *event) {
+	app_fsm_stop_timer(APP_EVENT_WIFI_TIMEOUT);
+	wake_prof_end_at(WAKE_PROF_WIFI, event->time_us);
+	BLOGI("WiFi", "ESP32 is connected to WiFi");
+	return is_data_http_prepared() ? APP_STATE_UPLINK : APP_STATE_SENSE;
+}
 
-				DEEP_SLEEP_PERIOD = (timer_value*60) * DEEP_SLEEP_CONVERT;
+//enter BLE mode if not connected, it falls back to WiFi mode after TIMEOUTPERIOD
+app_state_t sense_wifi_failed(const app_event_t *event) {
+	app_fsm_stop_timer(APP_EVENT_WIFI_TIMEOUT);
+	power_phase_end(POWER_PHASE_WIFI);
+	wake_prof_cancel(WAKE_PROF_WIFI);
+	ESP_LOGI("WiFi", "ESP32 is not connected to WiFi");
+	ESP_LOGI("WiFi", "Device might not have correct WiFi Credentials \n");
+	provision_timeout = true;
+	return APP_STATE_PROVISION;
+}
 
-				printf("Entering deep sleep for %.0f minutes\n", ((float)DEEP_SLEEP_PERIOD/60) / DEEP_SLEEP_CONVERT);
+//keep the window for cancelling deep sleep with the button, counted from boot
+app_state_t uplink_done(const app_event_t *event) {
+	int64_t awake_ms = (esp_timer_get_time() - wake_start_us) / 1000;
+	if (awake_ms < CANCEL_WINDOW_MS) {
+		ESP_LOGI(MAIN_TAG, "You have %lld ms to cancel deepsleep", CANCEL_WINDOW_MS - awake_ms);
+		app_fsm_start_timer(APP_EVENT_CANCEL_WINDOW, CANCEL_WINDOW_MS - awake_ms, false);
+		return APP_STATE_UPLINK;
+	}
+	return APP_STATE_SLEEP;
+}
 
-				vTaskDelay(10/portTICK_PERIOD_MS);
+//back to WiFi mode. After the user provisioned, sample again and upload. A fallback that timed out
+//only buffers a new sample and sleeps, the next wake tries the upload again
+app_state_t provision_exit(const app_event_t *event) {
+	bool timed_out = (event->type == APP_EVENT_PROVISION_TIMEOUT);
+	app_fsm_stop_timer(APP_EVENT_PROVISION_TIMEOUT);
+	provision_timeout = false;
 
-				//setup for deep sleep period
-				esp_sleep_enable_timer_wakeup(DEEP_SLEEP_PERIOD);
+	//the BLUFI tasks and the heap low point of the BLE session, found in mem_stats.c
+	mem_stats_sample();
+#if CONFIG_BT_ENABLED
+	ble_deinit();								// Disable Bluetooth to save power
+#endif
 
-				// Enter deep sleep mode
-				esp_deep_sleep_start();
+	//check for internet connection
+	if (is_wifi_connected()) {
+		ESP_LOGI("WiFi", "ESP32 is connected to WiFi");
+	} else {
+		ESP_LOGE("WiFi", "ESP32 is not connected to WiFi");
+	}
+	ESP_LOGI(MAIN_TAG, "Switched to WiFi mode");
 
-			}
+	//back on a battery wake. A timed-out fallback keeps the deadline of the wake, so a connection
+	//that keeps failing can not stretch it, only a user who provisioned gets a new budget
+	if (continuous_period_s == 0) {
+		if (timed_out) {
+			wake_guard_resume();
+		} else {
+			wake_guard_start(wake_overrun_rescue);
 		}
 	}
+	if (timed_out && !is_wifi_connected()) {
+		upload_wake = false;
+		return APP_STATE_SENSE;
+	}
+	//the credentials may have changed, connect again, function found in wifi.c
+	wifi_connect_reset();
+	upload_wake = true;
+	return APP_STATE_SENSE;
+}
+
+//continuous mode, one forced sample per period, the readers are stopped in between
+app_state_t sleep_period(const app_event_t *event) {
+	bme280_sample_once();
+	max_sample_once();
+	bool complete = bme280_wait_for_sample(SENSOR_READY_TIMEOUT / portTICK_PERIOD_MS);
+	complete = max_wait_for_sample(SENSOR_READY_TIMEOUT / portTICK_PERIOD_MS) && complete;
+	stop_bme280();
+	stop_max();
+	if (!complete) {
+		ESP_LOGE(MAIN_TAG, "sensor sample timeout, sending the last values");
+	}
+
+	mem_stats_sample();
+	prepare_data_http(app_config.name, temp-TEMPCALIBRATION, hum, soc);
+	return APP_STATE_UPLINK;
 }
 
 
+//Transition table, events without a row for the current state are ignored
+const app_fsm_transition_t app_transitions[] = {
+		{ APP_STATE_BOOT,      APP_EVENT_START,             boot_start },
+		{ APP_STATE_SENSE,     APP_EVENT_SENSOR_READY,      sense_sample },
+		{ APP_STATE_SENSE,     APP_EVENT_SENSOR_TIMEOUT,    sense_sample },
+		{ APP_STATE_SENSE,     APP_EVENT_WIFI_GOT_IP,       sense_got_ip },
+		{ APP_STATE_SENSE,     APP_EVENT_WIFI_FAILED,       sense_wifi_failed },
+		{ APP_STATE_SENSE,     APP_EVENT_WIFI_TIMEOUT,      sense_wifi_failed },
+		{ APP_STATE_SENSE,     APP_EVENT_BUTTON,            go_provision },
+		{ APP_STATE_UPLINK,    APP_EVENT_UPLOAD_DONE,       uplink_done },
+		{ APP_STATE_UPLINK,    APP_EVENT_CANCEL_WINDOW,     go_sleep },
+		{ APP_STATE_UPLINK,    APP_EVENT_BUTTON,            go_provision },
+		{ APP_STATE_PROVISION, APP_EVENT_BUTTON,            provision_exit },
+		{ APP_STATE_PROVISION, APP_EVENT_PROVISION_TIMEOUT, provision_exit },
+		{ APP_STATE_SLEEP,     APP_EVENT_PERIOD,            sleep_period },
+		{ APP_STATE_SLEEP,     APP_EVENT_BUTTON,            go_provision },
+};
+
+const app_fsm_enter_t app_enter_actions[APP_STATE_COUNT] = {
+		[APP_STATE_SENSE] = sense_enter,
+		[APP_STATE_UPLINK] = uplink_enter,
+		[APP_STATE_PROVISION] = provision_enter,
+		[APP_STATE_SLEEP] = sleep_enter,
+};
+
+
+//main application
+void app_main(void) {
+	wake_start_us = esp_timer_get_time();
+
+	//after a switch between the images, the RTC state the other image saved before esp_restart, found in app_image.c
+	bool handover_wake_done = false;
+	app_image_restore_state(&handover_wake_done);
+
+	//every wake ends in deep sleep within its budget, stopped again for provisioning and continuous mode
+	wake_guard_start(wake_overrun_rescue);
+
+	//scale the clock down in every blocking wait, radio and crypto work holds it at max
+	power_init();
+
+	run_led_init();
+
+	i2c_master_init();
+
+	app_fsm_init(app_transitions, sizeof(app_transitions) / sizeof(app_transitions[0]), app_enter_actions);
+
+	gpio_config_t io_conf;
+	io_conf.intr_type = GPIO_INTR_NEGEDGE;
+	io_conf.pin_bit_mask = (1ULL << BLE_BUTTON);
+	io_conf.mode = GPIO_MODE_INPUT;
+	io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+	gpio_config(&io_conf);
+	gpio_install_isr_service(0);
+	gpio_isr_handler_add(BLE_BUTTON, button_callback, NULL);
+
+	//the custom configuration, the sleep schedule depends on it, function found in app_config.c
+	app_config_load();
+	//the provisioning image already sampled and uploaded on this wake, only the deep sleep is left
+	handover_sleep = handover_wake_done && app_config.continuous_s == 0;
+	//the configured cadence scaled by the battery level decided on the last full wake, found in batt_policy.c
+	batt_policy_init(app_config.timer_min * 60, app_config.upload_every, app_config.max_period_s);
+	sleep_sched_init(batt_policy_period_s(), batt_policy_upload_every(), !handover_sleep);
+	//on timer wakes from the scheduled wake time, so ROM and bootloader are included
+	int64_t wake_latency_us = sleep_sched_wake_latency_us();
+	wake_prof_set(WAKE_PROF_BOOT, wake_latency_us > 0 ? wake_latency_us : esp_timer_get_time());
+	continuous_period_s = app_config.continuous_s;
+
+	app_image_report();
+
+	//a restart requested for provisioning, from this image or the sensing image
+	provisioning_boot = app_image_provisioning_requested(&provision_timeout);
+#if CONFIG_BT_ENABLED
+	//every other wake returns the BT memory to the heap
+	if (!provisioning_boot) {
+		ble_release_memory();
+	}
+#endif
+
+	//wakes between uploads only buffer the sample and never start the radio, holding the button forces an upload wake
+	upload_wake = sleep_sched_upload_due() || gpio_get_level(BLE_BUTTON) == 0;
 
+	//everything from here on is driven by events, found in app_fsm.c
+	app_fsm_post(APP_EVENT_START, 0);
+	app_fsm_run();
+}
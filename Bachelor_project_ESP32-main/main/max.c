@@ -9,9 +9,14 @@
 #include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
 #include "driver/i2c.h"
 #include "esp_log.h"
+#define BLOG_LEVEL ESP_LOG_INFO
+#include "blog.h"
 #include "max.h"
+#include "app_fsm.h"
+#include "mem_stats.h"
 #include "stdbool.h"
 #include "esp_err.h"
 #include "string.h"
@@ -28,20 +33,34 @@ TaskHandle_t max_reader_task_handle = NULL;
 #define ACK_VAL                     0x0     /*!< I2C ack value */
 #define NACK_VAL                    0x1     /*!< I2C nack value */
 #define SOC_REG                     0x04    /*!< Register address for SoC */
+#define CRATE_REG                   0x16    /*!< Register address for the charge rate, signed */
+#define CRATE_LSB                   0.208   /*!< %/hr per CRATE bit */
 #define CONFIG_REG 0x0C // Example register address
 #define MODE_REG 0x06  // Address of the Mode Register
 #define TAG_MAX "max17048"
 
 static bool sensor_initialized = false;
+static bool quick_started = false;		// once per boot, a quick start resets the SoC estimate
+static bool max_one_shot = false;		// one reading, then the reader waits to be stopped
 
 volatile double soc = 0.0;
+volatile double crate = 0.0;			// %/hr, negative while discharging
+
+//set by the reader task once the first state of charge is stored in soc
+#define MAX_SAMPLE_READY_BIT BIT0
+static EventGroupHandle_t max_event_group = NULL;
+static StaticEventGroup_t max_event_group_buffer;
+
+static StackType_t max_reader_stack[MAX_READER_STACK_SIZE];
+static StaticTask_t max_reader_tcb;
 
 static esp_err_t read_from_max17048(uint8_t reg_addr, uint8_t *data, size_t len) {
 	if (data == NULL) {
 		return ESP_FAIL;
 	}
 
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+	uint8_t cmd_buffer[MAX_I2C_LINK_SIZE];
+	i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(cmd_buffer, sizeof(cmd_buffer));
 	i2c_master_start(cmd);
 	i2c_master_write_byte(cmd, ( MAX17048_SENSOR_ADDR << 1) | I2C_MASTER_WRITE, true);
 	i2c_master_write_byte(cmd, reg_addr, ACK_CHECK_EN);
@@ -53,7 +72,7 @@ static esp_err_t read_from_max17048(uint8_t reg_addr, uint8_t *data, size_t len)
 	i2c_master_read_byte(cmd, data + len - 1, NACK_VAL);
 	i2c_master_stop(cmd);
 	esp_err_t ret = i2c_master_cmd_begin(I2C_MASTER_NUM, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
+	i2c_cmd_link_delete_static(cmd);
 	return ret;
 }
 
@@ -62,14 +81,15 @@ esp_err_t i2c_write_bytes(i2c_port_t i2c_num, uint8_t device_addr, uint8_t reg_a
 		return ESP_FAIL;
 	}
 
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+	uint8_t cmd_buffer[MAX_I2C_LINK_SIZE];
+	i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(cmd_buffer, sizeof(cmd_buffer));
 	i2c_master_start(cmd);
 	i2c_master_write_byte(cmd, (device_addr << 1) | I2C_MASTER_WRITE, true);
 	i2c_master_write_byte(cmd, reg_addr, true);
 	i2c_master_write(cmd, data, len, true);
 	i2c_master_stop(cmd);
 	esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_PERIOD_MS);
-	i2c_cmd_link_delete(cmd);
+	i2c_cmd_link_delete_static(cmd);
 	return ret;
 }
 
@@ -120,45 +140,99 @@ void max_reader_task(void *ignore) {
 			uint16_t voltage = ((uint16_t)data[0] << 8) | data[1];
 			float voltage_converted = voltage/12000; // conversion to volts v1
 			//float voltage_converted = (voltage*1.25f)/1000; // conversion to volts v2
-			ESP_LOGI(TAG_MAX, "Battery Voltage: %.2f V", voltage_converted);
+			BLOGI(TAG_MAX, "Battery Voltage: %.2f V", voltage_converted);
 
 		} else {
 			ESP_LOGE(TAG_MAX, "Failed to read voltage");
 		}
 
+		// Read the charge rate before the SoC, the battery policy takes both once the SoC is ready
+		ret = read_from_max17048(CRATE_REG, data, 2);
+		if (ret == ESP_OK) {
+			int16_t raw_crate = (int16_t)(((uint16_t)data[0] << 8) | data[1]);
+			crate = raw_crate * CRATE_LSB;
+			BLOGD(TAG_MAX, "Charge rate: %.2f %%/hr", crate);
+		} else {
+			ESP_LOGE(TAG_MAX, "Failed to read charge rate");
+		}
+
 		// Read State of Charge from MAX17048
 		ret = read_from_max17048(SOC_REG, data, 2);
 		if (ret == ESP_OK) {
 			uint16_t raw_soc = ((uint16_t)data[0] << 8) | data[1];
 			float state_of_charge = raw_soc * 1.0 / 256.0; // Convert raw SOC to percentage
-			ESP_LOGI(TAG_MAX, "Battery SoC: %.2f%%", state_of_charge);
+			BLOGI(TAG_MAX, "Battery SoC: %.2f%%", state_of_charge);
 			soc = state_of_charge;
+			if ((xEventGroupGetBits(max_event_group) & MAX_SAMPLE_READY_BIT) == 0) {
+				app_fsm_post(APP_EVENT_SENSOR_READY, APP_SENSOR_MAX17048);
+			}
+			xEventGroupSetBits(max_event_group, MAX_SAMPLE_READY_BIT);
 		} else {
 			ESP_LOGE(TAG_MAX, "Failed to read SoC");
 		}
 
+		if (max_one_shot) {
+			break;
+		}
 		vTaskDelay(pdMS_TO_TICKS(1000));
 	}
-	vTaskDelete(NULL);
+	//wait for stop_max, a self-deleted static task could be started again before the idle task cleaned it up
+	vTaskSuspend(NULL);
 }
 
-void max_main(void) {
+static void max_start_reader(void) {
 	esp_err_t err;
-	enable_quick_start(I2C_MASTER_NUM);
-	err = read_version_number(I2C_MASTER_NUM);
-	if (err != ESP_OK) {
-		ESP_LOGE(TAG_MAX, "Failed to read version number");
+	if (max_event_group == NULL) {
+		max_event_group = xEventGroupCreateStatic(&max_event_group_buffer);
 	}
 
 	if(!sensor_initialized){
-		xTaskCreate(max_reader_task, "max_reader_task", 4096, NULL, 5, &max_reader_task_handle);
+		//only on the first start, a quick start on every continuous mode sample would reset the SoC estimate
+		if (!quick_started) {
+			enable_quick_start(I2C_MASTER_NUM);
+			err = read_version_number(I2C_MASTER_NUM);
+			if (err != ESP_OK) {
+				ESP_LOGE(TAG_MAX, "Failed to read version number");
+			}
+			quick_started = true;
+		}
+
+		xEventGroupClearBits(max_event_group, MAX_SAMPLE_READY_BIT);
+		max_reader_task_handle = xTaskCreateStatic(max_reader_task, "max_reader_task", MAX_READER_STACK_SIZE, NULL, 5,
+				max_reader_stack, &max_reader_tcb);
 		sensor_initialized=true;
 	}
 
 }
 
+//the reader polls every second until stop_max
+void max_main(void) {
+	if (!sensor_initialized) {
+		max_one_shot = false;
+	}
+	max_start_reader();
+}
+
+//one reading, wait with max_wait_for_sample and stop the reader with stop_max
+void max_sample_once(void) {
+	if (!sensor_initialized) {
+		max_one_shot = true;
+	}
+	max_start_reader();
+}
+
+//blocks until the reader task has produced a state of charge, returns false on timeout
+bool max_wait_for_sample(TickType_t timeout){
+	if (max_event_group == NULL) {
+		return false;
+	}
+	EventBits_t bits = xEventGroupWaitBits(max_event_group, MAX_SAMPLE_READY_BIT, pdFALSE, pdTRUE, timeout);
+	return (bits & MAX_SAMPLE_READY_BIT) != 0;
+}
+
 void stop_max(void){
 	if (max_reader_task_handle != NULL) {
+		mem_stats_task(max_reader_task_handle);
 		vTaskDelete(max_reader_task_handle);
 		max_reader_task_handle = NULL; // Reset the task handle
 		sensor_initialized = false; // Reset the initialization flag
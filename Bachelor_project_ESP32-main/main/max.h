@@ -8,10 +8,18 @@
 #ifndef MAIN_MAX_H_
 #define MAIN_MAX_H_
 
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/i2c.h"
 
+#define MAX_READER_STACK_SIZE 4096			// bytes, printf of floats in the log is the deepest path
+#define MAX_I2C_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(2)	// command link buffer, a register read has a repeated start
 
 extern volatile double soc;
+extern volatile double crate;
 void max_main(void);
+void max_sample_once(void);
 void stop_max(void);
+bool max_wait_for_sample(TickType_t timeout);
 
 #endif /* MAIN_MAX_H_ */
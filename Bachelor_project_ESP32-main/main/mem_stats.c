@@ -0,0 +1,123 @@
+/*
+ * mem_stats.c
+ *
+ *  Tasks created by this project report themselves with mem_stats_task before they are
+ *  deleted, system tasks are looked up by name in mem_stats_sample. The minimum free heap
+ *  comes from the allocator, which tracks it since boot.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "mem_stats.h"
+
+#define TAG_MEM "MEM_STATS"
+
+#define MEM_STATS_MAGIC 0x4D454D31
+
+typedef struct {
+	char name[configMAX_TASK_NAME_LEN];
+	uint32_t min_free;						// lowest stack high water mark in bytes
+} mem_stats_task_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t heap_min[3];					// minimum free bytes for each entry of heap_caps
+	uint8_t task_count;
+	mem_stats_task_t tasks[MEM_STATS_MAX_TASKS];
+} mem_stats_t;
+
+RTC_DATA_ATTR static mem_stats_t mem_stats;
+
+static const struct {
+	uint32_t caps;
+	const char *field;
+} heap_caps[] = {
+		{ MALLOC_CAP_8BIT,     "heap_min" },
+		{ MALLOC_CAP_INTERNAL, "int_min" },
+		{ MALLOC_CAP_DMA,      "dma_min" },
+};
+
+//tasks of ESP-IDF that run on every wake or during BLUFI, the ones not running are skipped
+static const char *system_tasks[] = { "main", "esp_timer", "sys_evt", "tiT", "wifi", "nimble_host" };
+
+static void mem_stats_init(void) {
+	if (mem_stats.magic == MEM_STATS_MAGIC) {
+		return;
+	}
+	memset(&mem_stats, 0, sizeof(mem_stats));
+	for (int i = 0; i < sizeof(heap_caps) / sizeof(heap_caps[0]); i++) {
+		mem_stats.heap_min[i] = UINT32_MAX;
+	}
+	mem_stats.magic = MEM_STATS_MAGIC;
+}
+
+static void record_task(const char *name, uint32_t free_bytes) {
+	mem_stats_task_t *entry = NULL;
+	for (int i = 0; i < mem_stats.task_count; i++) {
+		if (strncmp(mem_stats.tasks[i].name, name, sizeof(entry->name)) == 0) {
+			entry = &mem_stats.tasks[i];
+			break;
+		}
+	}
+	if (entry == NULL) {
+		if (mem_stats.task_count == MEM_STATS_MAX_TASKS) {
+			return;
+		}
+		entry = &mem_stats.tasks[mem_stats.task_count++];
+		strlcpy(entry->name, name, sizeof(entry->name));
+		entry->min_free = UINT32_MAX;
+	}
+	if (free_bytes < entry->min_free) {
+		entry->min_free = free_bytes;
+	}
+}
+
+//stack headroom of a task, NULL for the calling task, call it before the task is deleted
+void mem_stats_task(TaskHandle_t task) {
+	mem_stats_init();
+	uint32_t free_bytes = uxTaskGetStackHighWaterMark(task) * sizeof(StackType_t);
+	const char *name = pcTaskGetName(task);
+	ESP_LOGI(TAG_MEM, "%s stack high water mark %lu bytes", name, (unsigned long)free_bytes);
+	record_task(name, free_bytes);
+}
+
+//system tasks and the heap minima, called before the payload is encoded and before deep sleep
+void mem_stats_sample(void) {
+	mem_stats_init();
+	for (int i = 0; i < sizeof(system_tasks) / sizeof(system_tasks[0]); i++) {
+		TaskHandle_t task = xTaskGetHandle(system_tasks[i]);
+		if (task != NULL) {
+			record_task(system_tasks[i], uxTaskGetStackHighWaterMark(task) * sizeof(StackType_t));
+		}
+	}
+	for (int i = 0; i < sizeof(heap_caps) / sizeof(heap_caps[0]); i++) {
+		uint32_t min_free = heap_caps_get_minimum_free_size(heap_caps[i].caps);
+		if (min_free < mem_stats.heap_min[i]) {
+			mem_stats.heap_min[i] = min_free;
+		}
+	}
+}
+
+//worst case since power on as form fields, "&heap_min=..&int_min=..&dma_min=..&stack_min=task:bytes,..."
+size_t mem_stats_format(char *buf, size_t len) {
+	size_t pos = 0;
+
+	mem_stats_init();
+	for (int i = 0; i < sizeof(heap_caps) / sizeof(heap_caps[0]) && pos < len; i++) {
+		pos += snprintf(buf + pos, len - pos, "&%s=%lu", heap_caps[i].field, (unsigned long)mem_stats.heap_min[i]);
+	}
+	for (int i = 0; i < mem_stats.task_count && pos < len; i++) {
+		pos += snprintf(buf + pos, len - pos, "%s%s:%lu", i == 0 ? "&stack_min=" : ",",
+				mem_stats.tasks[i].name, (unsigned long)mem_stats.tasks[i].min_free);
+	}
+	return pos < len ? pos : len - 1;
+}
+
+//the low points since power on, kept through an image switch
+void *mem_stats_rtc_state(size_t *len) {
+	*len = sizeof(mem_stats);
+	return &mem_stats;
+}
@@ -0,0 +1,24 @@
+/*
+ * mem_stats.h
+ *
+ *  Memory telemetry: the lowest stack headroom seen per task and the minimum free heap per
+ *  capability, kept as a worst case across wakes in RTC memory and sent with every upload
+ *  so stack sizes can be shrunk against fleet data.
+ */
+
+#ifndef MAIN_MEM_STATS_H_
+#define MAIN_MEM_STATS_H_
+
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define MEM_STATS_MAX_TASKS 10				// tasks tracked, later ones are not recorded
+#define MEM_STATS_FORM_LEN 320				// longest form fields mem_stats_format writes
+
+void mem_stats_task(TaskHandle_t task);
+void mem_stats_sample(void);
+size_t mem_stats_format(char *buf, size_t len);
+void *mem_stats_rtc_state(size_t *len);
+
+#endif /* MAIN_MEM_STATS_H_ */
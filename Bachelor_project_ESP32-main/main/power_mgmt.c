@@ -0,0 +1,133 @@
+/*
+ * power_mgmt.c
+ *
+ *  Needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in sdkconfig. With
+ *  CONFIG_PM_PROFILING set the report also dumps the time spent in each esp_pm mode.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include "esp_pm.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_clk_tree.h"
+#include "freertos/FreeRTOS.h"
+
+#include "power_mgmt.h"
+
+#define TAG_POWER "POWER"
+
+typedef struct {
+	const char *name;
+	bool locked;								// holds the max frequency lock while active
+	bool active;
+	int64_t start_us;
+	int64_t total_us;
+	uint32_t count;
+	uint32_t freq_mhz;							// CPU clock when the phase last ended
+} power_phase_stat_t;
+
+static power_phase_stat_t phases[POWER_PHASE_COUNT] = {
+		[POWER_PHASE_WIFI]   = { .name = "wifi",   .locked = true },
+		[POWER_PHASE_HTTP]   = { .name = "http",   .locked = true },
+		[POWER_PHASE_CRYPTO] = { .name = "crypto", .locked = true },
+		[POWER_PHASE_SENSOR] = { .name = "sensor", .locked = false },
+};
+
+static esp_pm_lock_handle_t cpu_max_lock = NULL;
+//phases are begun and ended from the main, sys_evt and BT tasks
+static portMUX_TYPE phase_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_err_t power_configure(bool light_sleep) {
+	esp_pm_config_t pm_config = {
+			.max_freq_mhz = POWER_MAX_CPU_FREQ_MHZ,
+			.min_freq_mhz = POWER_MIN_CPU_FREQ_MHZ,
+			.light_sleep_enable = light_sleep,
+	};
+	esp_err_t err = esp_pm_configure(&pm_config);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG_POWER, "esp_pm_configure failed: %s", esp_err_to_name(err));
+	}
+	return err;
+}
+
+//frequency scaling only, the clock drops to POWER_MIN_CPU_FREQ_MHZ while every task is blocked
+esp_err_t power_init(void) {
+	if (cpu_max_lock == NULL) {
+		esp_err_t err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "phase", &cpu_max_lock);
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG_POWER, "esp_pm_lock_create failed: %s", esp_err_to_name(err));
+			return err;
+		}
+	}
+	esp_err_t err = power_configure(false);
+	if (err == ESP_OK) {
+		ESP_LOGI(TAG_POWER, "frequency scaling enabled, %d-%d MHz", POWER_MIN_CPU_FREQ_MHZ, POWER_MAX_CPU_FREQ_MHZ);
+	}
+	return err;
+}
+
+//frequency scaling plus automatic light sleep whenever all tasks are blocked
+esp_err_t power_enable_light_sleep(void) {
+	esp_err_t err = power_configure(true);
+	if (err == ESP_OK) {
+		ESP_LOGI(TAG_POWER, "automatic light sleep enabled, %d-%d MHz", POWER_MIN_CPU_FREQ_MHZ, POWER_MAX_CPU_FREQ_MHZ);
+	}
+	return err;
+}
+
+void power_phase_begin(power_phase_t phase) {
+	power_phase_stat_t *stat = &phases[phase];
+	portENTER_CRITICAL(&phase_lock);
+	if (stat->active) {
+		portEXIT_CRITICAL(&phase_lock);
+		return;
+	}
+	//esp_pm locks are ISR safe and do not block, the acquire stays paired with the active flag
+	if (stat->locked && cpu_max_lock != NULL) {
+		esp_pm_lock_acquire(cpu_max_lock);
+	}
+	stat->active = true;
+	stat->start_us = esp_timer_get_time();
+	portEXIT_CRITICAL(&phase_lock);
+}
+
+//safe to call for a phase that is not running, the WiFi phase has several possible ends
+void power_phase_end(power_phase_t phase) {
+	power_phase_stat_t *stat = &phases[phase];
+	uint32_t cpu_freq_hz = 0;
+	esp_clk_tree_src_get_freq_hz(SOC_MOD_CLK_CPU, ESP_CLK_TREE_SRC_FREQ_PRECISION_CACHED, &cpu_freq_hz);
+
+	portENTER_CRITICAL(&phase_lock);
+	if (!stat->active) {
+		portEXIT_CRITICAL(&phase_lock);
+		return;
+	}
+	stat->total_us += esp_timer_get_time() - stat->start_us;
+	stat->count++;
+	stat->freq_mhz = cpu_freq_hz / 1000000;
+	stat->active = false;
+	if (stat->locked && cpu_max_lock != NULL) {
+		esp_pm_lock_release(cpu_max_lock);
+	}
+	portEXIT_CRITICAL(&phase_lock);
+}
+
+//time spent in each phase and the clock it ran at, the rest of the wake ran at the DFS minimum when idle
+void power_report(void) {
+	for (int i = 0; i < POWER_PHASE_COUNT; i++) {
+		power_phase_stat_t *stat = &phases[i];
+		if (stat->count == 0) {
+			continue;
+		}
+		if (stat->locked) {
+			ESP_LOGI(TAG_POWER, "%-6s %5lld ms in %lu runs, held at %lu MHz", stat->name,
+					stat->total_us / 1000, (unsigned long)stat->count, (unsigned long)stat->freq_mhz);
+		} else {
+			ESP_LOGI(TAG_POWER, "%-6s %5lld ms in %lu runs, unlocked %d-%d MHz", stat->name,
+					stat->total_us / 1000, (unsigned long)stat->count, POWER_MIN_CPU_FREQ_MHZ, POWER_MAX_CPU_FREQ_MHZ);
+		}
+	}
+#if CONFIG_PM_PROFILING
+	esp_pm_dump_locks(stdout);
+#endif
+}
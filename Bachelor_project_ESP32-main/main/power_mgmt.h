@@ -0,0 +1,32 @@
+/*
+ * power_mgmt.h
+ *
+ *  esp_pm configuration. Every node scales the CPU clock down whenever no phase below holds
+ *  the max frequency lock, mains powered nodes in continuous mode also use automatic light
+ *  sleep between samples.
+ */
+
+#ifndef MAIN_POWER_MGMT_H_
+#define MAIN_POWER_MGMT_H_
+
+#include "esp_err.h"
+
+#define POWER_MAX_CPU_FREQ_MHZ 160
+#define POWER_MIN_CPU_FREQ_MHZ 40				// XTAL frequency, the lowest the C3 can run at with WiFi on
+
+//phases of a wake that are timed, the locked ones run at POWER_MAX_CPU_FREQ_MHZ
+typedef enum {
+	POWER_PHASE_WIFI,							// driver init until the station has an IP, locked
+	POWER_PHASE_HTTP,							// each post to the upload server, locked
+	POWER_PHASE_CRYPTO,							// BLUFI key exchange and AES, locked
+	POWER_PHASE_SENSOR,							// waiting for the I2C conversions, the clock may drop
+	POWER_PHASE_COUNT
+} power_phase_t;
+
+esp_err_t power_init(void);
+esp_err_t power_enable_light_sleep(void);
+void power_phase_begin(power_phase_t phase);
+void power_phase_end(power_phase_t phase);
+void power_report(void);
+
+#endif /* MAIN_POWER_MGMT_H_ */
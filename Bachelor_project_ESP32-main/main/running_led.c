@@ -1,50 +1,75 @@
 #include <stdio.h>
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
 #include "driver/gpio.h"
 
+#include "running_led.h"
+
 #define RUNNING_LED 4
 
-TaskHandle_t run_led_task_handle = NULL; // Task handle for the LED blinking task
+#define TAG_LED "RUNNING_LED"
+
+// step lists start with the LED on and alternate on/off
+static const uint16_t blink_500_steps[] = { 500, 500 };
+static const uint16_t blink_100_steps[] = { 100, 100 };
+
+const led_pattern_t LED_PATTERN_OFF = { .steps_ms = NULL, .step_count = 0, .level = 0 };
+const led_pattern_t LED_PATTERN_SOLID = { .steps_ms = NULL, .step_count = 0, .level = 1 };
+const led_pattern_t LED_PATTERN_BLINK_500 = { .steps_ms = blink_500_steps, .step_count = 2 };
+const led_pattern_t LED_PATTERN_BLINK_100 = { .steps_ms = blink_100_steps, .step_count = 2 };
+
+// one-shot timer that re-arms itself for the next step, no task and no polling
+static esp_timer_handle_t led_timer = NULL;
+static const led_pattern_t *led_pattern = NULL;
+static uint8_t led_step = 0;
+static portMUX_TYPE led_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void led_apply_step(void) {
+    gpio_set_level(RUNNING_LED, (led_step & 1) ? 0 : 1);
+    esp_timer_start_once(led_timer, (uint64_t)led_pattern->steps_ms[led_step] * 1000);
+}
+
+static void led_timer_callback(void *arg) {
+    portENTER_CRITICAL(&led_lock);
+    if (led_pattern != NULL && led_pattern->step_count > 0) {
+        led_step = (led_step + 1) % led_pattern->step_count;
+        led_apply_step();
+    }
+    portEXIT_CRITICAL(&led_lock);
+}
 
 void run_led_init(void){
     gpio_reset_pin(RUNNING_LED);
     gpio_set_direction(RUNNING_LED, GPIO_MODE_OUTPUT);
-}
 
-void run_led_task(void *pvParameters) {
-    int delay_ms = *((int *)pvParameters);
-    while (1) {
-        gpio_set_level(RUNNING_LED, 1); // Turn on the LED
-        vTaskDelay(delay_ms / portTICK_PERIOD_MS); // Delay for the specified time in milliseconds
-        gpio_set_level(RUNNING_LED, 0); // Turn off the LED
-        vTaskDelay(delay_ms / portTICK_PERIOD_MS); // Delay for the specified time again
-    }
+    const esp_timer_create_args_t timer_args = {
+            .callback = &led_timer_callback,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "running_led",
+            .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &led_timer));
 }
 
-void start_led_task(int delay_ms) {
-    if (run_led_task_handle == NULL) {
-        // Create the LED task if it hasn't been created yet
-        xTaskCreate(run_led_task, "run_led_task", 2048, &delay_ms, configMAX_PRIORITIES - 1, &run_led_task_handle);
+// switch to a new pattern, setting the pattern that is already running does nothing
+void led_set_pattern(const led_pattern_t *pattern) {
+    if (led_timer == NULL) {
+        ESP_LOGE(TAG_LED, "run_led_init has not been called");
+        return;
     }
-    else {
-        // Update the delay time if the task is already running
-        vTaskDelay(10 / portTICK_PERIOD_MS); // Small delay for safety
-        vTaskSuspend(run_led_task_handle); // Suspend the task
-        vTaskDelay(10 / portTICK_PERIOD_MS); // Small delay for safety
-        vTaskDelete(run_led_task_handle); // Delete the task
-        xTaskCreate(run_led_task, "run_led_task", 2048, &delay_ms, configMAX_PRIORITIES - 1, &run_led_task_handle); // Create a new task with the updated delay time
-    }
-}
 
-void stop_led_task() {
-    if (run_led_task_handle != NULL) {
-        // Delete the LED task if it's running
-        vTaskDelay(10 / portTICK_PERIOD_MS); // Small delay for safety
-        vTaskSuspend(run_led_task_handle); // Suspend the task
-        vTaskDelay(10 / portTICK_PERIOD_MS); // Small delay for safety
-        vTaskDelete(run_led_task_handle); // Delete the task
-        run_led_task_handle = NULL; // Reset the task handle
+    portENTER_CRITICAL(&led_lock);
+    if (pattern != led_pattern) {
+        esp_timer_stop(led_timer);
+        led_pattern = pattern;
+        led_step = 0;
+        if (pattern->step_count > 0) {
+            led_apply_step();
+        } else {
+            gpio_set_level(RUNNING_LED, pattern->level);
+        }
     }
+    portEXIT_CRITICAL(&led_lock);
 }
-
@@ -1,4 +1,27 @@
+/*
+ * running_led.h
+ *
+ *  Status LED on GPIO 4, driven by an esp_timer one-shot chain instead of a task.
+ */
+
+#ifndef MAIN_RUNNING_LED_H_
+#define MAIN_RUNNING_LED_H_
+
+#include <stdint.h>
+
+// on/off durations in ms starting with on, patterns without steps hold level
+typedef struct {
+    const uint16_t *steps_ms;
+    uint8_t step_count;
+    uint8_t level;
+} led_pattern_t;
+
+extern const led_pattern_t LED_PATTERN_OFF;
+extern const led_pattern_t LED_PATTERN_SOLID;
+extern const led_pattern_t LED_PATTERN_BLINK_500;		// WiFi mode
+extern const led_pattern_t LED_PATTERN_BLINK_100;		// BLE mode and mode switches
+
 void run_led_init(void);
-void run_led_task(void *pvParameters);
-void start_led_task(int delay_ms);
-void stop_led_task();
+void led_set_pattern(const led_pattern_t *pattern);
+
+#endif /* MAIN_RUNNING_LED_H_ */
@@ -0,0 +1,139 @@
+/*
+ * sample_buf.c
+ *
+ *  Samples are stored as fixed point so one entry is 16 bytes of RTC memory.
+ *  sample_buf_push_raw runs from the wake stub and is kept in RTC memory with the ring.
+ *  The wake guard pushes from the esp_timer task while the main task may be uploading,
+ *  the other functions take sample_lock. The stub runs alone and cannot use it.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#include "sample_buf.h"
+#include "sensor_func.h"
+
+#define TAG_SAMPLE_BUF "SAMPLE_BUF"
+
+typedef struct {
+	uint8_t head;							// index of the oldest sample
+	uint8_t count;
+	rtc_sample_t samples[SAMPLE_BUF_LEN];
+} sample_ring_t;
+
+RTC_DATA_ATTR static sample_ring_t ring;
+
+static portMUX_TYPE sample_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void sample_buf_push(double temperature, double humidity, double charge) {
+	rtc_sample_t entry = {
+			.time_s = (uint32_t)time(NULL),
+			.temp = (int32_t)(temperature * 100),
+			.hum = (uint16_t)(humidity * 100),
+			.soc = (uint16_t)(charge * 100),
+			.flags = 0,
+	};
+	bool dropped = false;
+
+	portENTER_CRITICAL(&sample_lock);
+	if (ring.count == SAMPLE_BUF_LEN) {
+		ring.head = (ring.head + 1) % SAMPLE_BUF_LEN;
+		ring.count--;
+		dropped = true;
+	}
+	ring.samples[(ring.head + ring.count) % SAMPLE_BUF_LEN] = entry;
+	ring.count++;
+	portEXIT_CRITICAL(&sample_lock);
+
+	if (dropped) {
+		ESP_LOGW(TAG_SAMPLE_BUF, "buffer full, dropped oldest sample");
+	}
+}
+
+//called from the wake stub, only RTC memory and no floating point here
+void RTC_IRAM_ATTR sample_buf_push_raw(uint32_t time_s, int32_t adc_temp, uint16_t adc_hum, uint16_t soc) {
+	if (ring.count == SAMPLE_BUF_LEN) {
+		ring.head = (ring.head + 1) % SAMPLE_BUF_LEN;
+		ring.count--;
+	}
+
+	rtc_sample_t *sample = &ring.samples[(ring.head + ring.count) % SAMPLE_BUF_LEN];
+	sample->time_s = time_s;
+	sample->temp = adc_temp;
+	sample->hum = adc_hum;
+	sample->soc = soc;
+	sample->flags = SAMPLE_FLAG_RAW;
+	ring.count++;
+}
+
+//turn the raw wake stub entries into calibrated values, needs the BME280 calibration loaded
+void sample_buf_compensate(double temp_offset) {
+	size_t converted = 0;
+	for (size_t i = 0; ; i++) {
+		rtc_sample_t raw;
+		size_t slot = 0;
+		portENTER_CRITICAL(&sample_lock);
+		bool more = i < ring.count;
+		if (more) {
+			slot = (ring.head + i) % SAMPLE_BUF_LEN;
+			raw = ring.samples[slot];
+		}
+		portEXIT_CRITICAL(&sample_lock);
+		if (!more) {
+			break;
+		}
+
+		//the compensation takes the BME280 mutex, it runs outside the critical section
+		double temperature, humidity;
+		if (!(raw.flags & SAMPLE_FLAG_RAW)
+				|| !bme280_compensate_raw(raw.temp, raw.hum, &temperature, &humidity)) {
+			continue;
+		}
+		portENTER_CRITICAL(&sample_lock);
+		rtc_sample_t *sample = &ring.samples[slot];
+		if ((sample->flags & SAMPLE_FLAG_RAW) && sample->time_s == raw.time_s) {
+			sample->temp = (int32_t)((temperature - temp_offset) * 100);
+			sample->hum = (uint16_t)(humidity * 100);
+			sample->flags &= ~SAMPLE_FLAG_RAW;
+			converted++;
+		}
+		portEXIT_CRITICAL(&sample_lock);
+	}
+	if (converted > 0) {
+		ESP_LOGI(TAG_SAMPLE_BUF, "compensated %u wake stub samples", converted);
+	}
+}
+
+size_t sample_buf_count(void) {
+	return ring.count;
+}
+
+//index 0 is the oldest sample
+bool sample_buf_peek(size_t index, rtc_sample_t *sample) {
+	portENTER_CRITICAL(&sample_lock);
+	bool found = index < ring.count;
+	if (found) {
+		*sample = ring.samples[(ring.head + index) % SAMPLE_BUF_LEN];
+	}
+	portEXIT_CRITICAL(&sample_lock);
+	return found;
+}
+
+//remove the n oldest samples, typically after they were uploaded
+void sample_buf_drop(size_t n) {
+	portENTER_CRITICAL(&sample_lock);
+	if (n > ring.count) {
+		n = ring.count;
+	}
+	ring.head = (ring.head + n) % SAMPLE_BUF_LEN;
+	ring.count -= n;
+	portEXIT_CRITICAL(&sample_lock);
+}
+
+//the whole ring, app_image.c hands it to the other image on a switch
+void *sample_buf_rtc_state(size_t *len) {
+	*len = sizeof(ring);
+	return &ring;
+}
@@ -0,0 +1,37 @@
+/*
+ * sample_buf.h
+ *
+ *  Ring of sensor samples kept in RTC memory between deep sleep wakes, uploaded in a batch
+ *  when the upload cadence is due. The wake stub appends raw ADC values, they are
+ *  compensated once the full application has the BME280 calibration loaded.
+ */
+
+#ifndef MAIN_SAMPLE_BUF_H_
+#define MAIN_SAMPLE_BUF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SAMPLE_BUF_LEN 48 					// oldest sample is overwritten when the ring is full
+
+#define SAMPLE_FLAG_RAW 0x01 				// temp/hum hold raw BME280 ADC values from the wake stub
+#define SAMPLE_SOC_UNKNOWN 0xFFFF 			// the fuel gauge could not be read
+
+typedef struct {
+	uint32_t time_s;						// system time of the sample in seconds
+	int32_t temp;							// calibrated temperature in 0.01 degC, or the raw 20-bit ADC value
+	uint16_t hum;							// relative humidity in 0.01 %, or the raw 16-bit ADC value
+	uint16_t soc;							// state of charge in 0.01 %
+	uint8_t flags;
+} rtc_sample_t;
+
+void sample_buf_push(double temperature, double humidity, double charge);
+void sample_buf_push_raw(uint32_t time_s, int32_t adc_temp, uint16_t adc_hum, uint16_t soc);
+void sample_buf_compensate(double temp_offset);
+size_t sample_buf_count(void);
+bool sample_buf_peek(size_t index, rtc_sample_t *sample);
+void sample_buf_drop(size_t n);
+void *sample_buf_rtc_state(size_t *len);
+
+#endif /* MAIN_SAMPLE_BUF_H_ */
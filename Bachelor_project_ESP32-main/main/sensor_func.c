@@ -16,8 +16,13 @@
 #include <freertos/portmacro.h>
 #include <freertos/projdefs.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 #include "sensor_func.h"
+#include "app_fsm.h"
+#include "mem_stats.h"
 #include "esp_log.h"
+#define BLOG_LEVEL ESP_LOG_INFO
+#include "blog.h"
 #include "esp_http_client.h"
 
 
@@ -28,7 +33,22 @@ volatile double press = 0.0;
 
 TaskHandle_t bme280_reader_task_handle = NULL;
 
+//set by the reader task once the first compensated sample is stored in temp/hum/press
+#define BME280_SAMPLE_READY_BIT BIT0
+static EventGroupHandle_t bme280_event_group = NULL;
+
+//the compensation formulas share t_fine in the driver, the reader task and bme280_compensate_raw take turns
+static SemaphoreHandle_t bme280_mutex = NULL;
+static bool bme280_calibrated = false;
+
+//the reader is started and stopped on every wake, it always reuses the same stack and TCB
+static StackType_t bme280_reader_stack[BME280_READER_STACK_SIZE];
+static StaticTask_t bme280_reader_tcb;
+static StaticEventGroup_t bme280_event_group_buffer;
+static StaticSemaphore_t bme280_mutex_buffer;
+
 static bool sensor_initialized = false; // Flag to track initialization
+static bool bme280_one_shot = false;	// one forced conversion, then the reader waits to be stopped
 
 
 s8 BME280_I2C_bus_write(u8 dev_addr, u8 reg_addr, u8 *reg_data, u8 cnt)
@@ -36,7 +56,8 @@ s8 BME280_I2C_bus_write(u8 dev_addr, u8 reg_addr, u8 *reg_data, u8 cnt)
 	s32 iError = BME280_INIT_VALUE;
 
 	esp_err_t espRc;
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+	uint8_t cmd_buffer[BME280_I2C_LINK_SIZE];
+	i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(cmd_buffer, sizeof(cmd_buffer));
 
 	i2c_master_start(cmd);
 	i2c_master_write_byte(cmd, (dev_addr << 1) | I2C_MASTER_WRITE, true);
@@ -53,7 +74,7 @@ s8 BME280_I2C_bus_write(u8 dev_addr, u8 reg_addr, u8 *reg_data, u8 cnt)
 		iError = ERROR;
 	}
 
-	i2c_cmd_link_delete(cmd);
+	i2c_cmd_link_delete_static(cmd);
 
 	return (s8)iError;
 }
@@ -63,7 +84,8 @@ s8 BME280_I2C_bus_read(u8 dev_addr, u8 reg_addr, u8 *reg_data, u8 cnt)
 	s32 iError = BME280_INIT_VALUE;
 	esp_err_t espRc;
 
-	i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+	uint8_t cmd_buffer[BME280_I2C_LINK_SIZE];
+	i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(cmd_buffer, sizeof(cmd_buffer));
 
 	i2c_master_start(cmd);
 	i2c_master_write_byte(cmd, (dev_addr << 1) | I2C_MASTER_WRITE, true);
@@ -87,7 +109,7 @@ s8 BME280_I2C_bus_read(u8 dev_addr, u8 reg_addr, u8 *reg_data, u8 cnt)
 	}
 
 
-	i2c_cmd_link_delete(cmd);
+	i2c_cmd_link_delete_static(cmd);
 
 	return (s8)iError;
 }
@@ -121,60 +143,127 @@ void bme280_reader_task(void *ignore)
 	com_rslt += bme280_set_oversamp_humidity(BME280_OVERSAMP_1X);
 
 	com_rslt += bme280_set_standby_durn(BME280_STANDBY_TIME_1_MS);
-	com_rslt += bme280_set_filter(BME280_FILTER_COEFF_16);
-
-	com_rslt += bme280_set_power_mode(BME280_NORMAL_MODE);
+	if (bme280_one_shot) {
+		//the IIR filter needs a series of samples, a single forced conversion goes without it
+		com_rslt += bme280_set_filter(BME280_FILTER_COEFF_OFF);
+	} else {
+		com_rslt += bme280_set_filter(BME280_FILTER_COEFF_16);
+		com_rslt += bme280_set_power_mode(BME280_NORMAL_MODE);
+	}
 	if (com_rslt == SUCCESS) {
+		bme280_calibrated = true;
 		while(true) {
 
-			vTaskDelay(400 / portTICK_PERIOD_MS);
+			if (bme280_one_shot) {
+				//the sensor goes back to sleep mode after the conversion
+				com_rslt = bme280_get_forced_uncomp_pressure_temperature_humidity(
+						&v_uncomp_pressure_s32, &v_uncomp_temperature_s32, &v_uncomp_humidity_s32);
+			} else {
+				vTaskDelay(400 / portTICK_PERIOD_MS);
 
-			com_rslt = bme280_read_uncomp_pressure_temperature_humidity(
-					&v_uncomp_pressure_s32, &v_uncomp_temperature_s32, &v_uncomp_humidity_s32);
+				com_rslt = bme280_read_uncomp_pressure_temperature_humidity(
+						&v_uncomp_pressure_s32, &v_uncomp_temperature_s32, &v_uncomp_humidity_s32);
+			}
 
 			if (com_rslt == SUCCESS) {
+				xSemaphoreTake(bme280_mutex, portMAX_DELAY);
 				double temp_comp = bme280_compensate_temperature_double(v_uncomp_temperature_s32);
 				double press_comp = bme280_compensate_pressure_double(v_uncomp_pressure_s32) / 100;
 				double hum_comp = bme280_compensate_humidity_double(v_uncomp_humidity_s32);
+				xSemaphoreGive(bme280_mutex);
 
-				ESP_LOGI(TAG_BME280, "%.2f degC / %.3f hPa / %.3f %%",
+				BLOGI(TAG_BME280, "%.2f degC / %.3f hPa / %.3f %%",
 						temp_comp, press_comp, hum_comp);
 
 				// Update variables
 				temp = temp_comp;
 				press = press_comp;
 				hum = hum_comp;
-
+				if ((xEventGroupGetBits(bme280_event_group) & BME280_SAMPLE_READY_BIT) == 0) {
+					app_fsm_post(APP_EVENT_SENSOR_READY, APP_SENSOR_BME280);
+				}
+				xEventGroupSetBits(bme280_event_group, BME280_SAMPLE_READY_BIT);
+				if (bme280_one_shot) {
+					break;
+				}
 
 				vTaskDelay(100 / portTICK_PERIOD_MS);
 
 			} else {
 				ESP_LOGE(TAG_BME280, "measure error. code: %d", com_rslt);
+				if (bme280_one_shot) {
+					break;
+				}
 			}
 		}
 	} else {
 		ESP_LOGE(TAG_BME280, "init or setting error. code: %d", com_rslt);
 	}
 
-	vTaskDelete(NULL);
+	//wait for stop_bme280, a self-deleted static task could be started again before the idle task cleaned it up
+	vTaskSuspend(NULL);
 }
 
 
 
 
+static void bme280_start_reader(void){
+	if (bme280_event_group == NULL) {
+		bme280_event_group = xEventGroupCreateStatic(&bme280_event_group_buffer);
+		bme280_mutex = xSemaphoreCreateMutexStatic(&bme280_mutex_buffer);
+	}
+	xEventGroupClearBits(bme280_event_group, BME280_SAMPLE_READY_BIT);
+	bme280_reader_task_handle = xTaskCreateStatic(&bme280_reader_task, "bme280_reader_task", BME280_READER_STACK_SIZE,
+			NULL, 6, bme280_reader_stack, &bme280_reader_tcb);
+	sensor_initialized = true;
+}
+
+//the reader samples continuously until stop_bme280
 void bme280_sensor_func(void){
 	if (!sensor_initialized) {
-		xTaskCreate(&bme280_reader_task, "bme280_reader_task", 4096, NULL, 6, &bme280_reader_task_handle);
-		sensor_initialized = true;
+		bme280_one_shot = false;
+		bme280_start_reader();
+	}
+}
 
+//one forced conversion, wait with bme280_wait_for_sample and stop the reader with stop_bme280
+void bme280_sample_once(void){
+	if (!sensor_initialized) {
+		bme280_one_shot = true;
+		bme280_start_reader();
 	}
 }
 
 
 
+//blocks until the reader task has produced a sample, returns false on timeout
+bool bme280_wait_for_sample(TickType_t timeout){
+	if (bme280_event_group == NULL) {
+		return false;
+	}
+	EventBits_t bits = xEventGroupWaitBits(bme280_event_group, BME280_SAMPLE_READY_BIT, pdFALSE, pdTRUE, timeout);
+	return (bits & BME280_SAMPLE_READY_BIT) != 0;
+}
+
+//compensate raw ADC values taken by the wake stub, uses the calibration read by bme280_init
+bool bme280_compensate_raw(int32_t adc_temp, int32_t adc_hum, double *temperature, double *humidity){
+	if (!bme280_calibrated) {
+		return false;
+	}
+	xSemaphoreTake(bme280_mutex, portMAX_DELAY);
+	*temperature = bme280_compensate_temperature_double(adc_temp);
+	*humidity = bme280_compensate_humidity_double(adc_hum);
+	xSemaphoreGive(bme280_mutex);
+	return true;
+}
+
 void stop_bme280(void){
 	if (bme280_reader_task_handle != NULL) {
+		//never delete the reader while it holds the compensation mutex
+		xSemaphoreTake(bme280_mutex, portMAX_DELAY);
+		mem_stats_task(bme280_reader_task_handle);
 		vTaskDelete(bme280_reader_task_handle);
+		xSemaphoreGive(bme280_mutex);
 		bme280_reader_task_handle = NULL; // Reset the task handle
 		sensor_initialized = false; // Reset the initialization flag
 		ESP_LOGE(TAG_BME280, "BME280_reader task stopped! \n");
@@ -1,13 +1,24 @@
 #ifndef SENSOR_FUNC_H_
 #define SENSOR_FUNC_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/i2c.h"
+
 extern volatile double hum;
 extern volatile double temp;
 
 #define my_device_name
 
+#define BME280_READER_STACK_SIZE 4096		// bytes, printf of doubles in the log is the deepest path
+#define BME280_I2C_LINK_SIZE I2C_LINK_RECOMMENDED_SIZE(2)	// command link buffer, a register read has a repeated start
+
 void bme280_sensor_func(void);
+void bme280_sample_once(void);
 void stop_bme280(void);
+bool bme280_wait_for_sample(TickType_t timeout);
+bool bme280_compensate_raw(int32_t adc_temp, int32_t adc_hum, double *temperature, double *humidity);
 
 
 
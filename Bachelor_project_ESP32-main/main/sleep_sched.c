@@ -0,0 +1,155 @@
+/*
+ * sleep_sched.c
+ *
+ *  All times are 64-bit microseconds of system time, so periods are not limited by the
+ *  uint32_t microsecond overflow at about 71 minutes.
+ */
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_sleep.h"
+
+#include "sleep_sched.h"
+#include "sample_buf.h"
+#include "wake_stub.h"
+#include "wake_prof.h"
+
+#define TAG_SLEEP "SLEEP_SCHED"
+
+#define SLEEP_SCHED_MAGIC 0x534c5031			// "SLP1", tells a valid RTC state from power-on garbage
+
+typedef struct {
+	uint32_t magic;
+	int64_t next_wake_us;					// absolute system time the current sleep was set to end at
+	uint32_t samples_pending;				// samples taken since the last successful upload
+} sleep_sched_state_t;
+
+RTC_DATA_ATTR static sleep_sched_state_t sched_state;
+
+static int64_t period_us;
+static int64_t phase_us;
+static uint32_t upload_cadence;
+static bool timer_wake;
+static int64_t wake_latency_us;
+
+static int64_t sched_now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static int64_t floor_div(int64_t a, int64_t b) {
+	int64_t q = a / b;
+	return (a % b != 0 && a < 0) ? q - 1 : q;
+}
+
+//stable per-device offset inside the jitter window, derived from the station MAC
+static int64_t device_phase_us(int64_t period) {
+	uint8_t mac[6] = {0};
+	uint32_t hash = 2166136261u;				// FNV-1a
+	esp_read_mac(mac, ESP_MAC_WIFI_STA);
+	for (size_t i = 0; i < sizeof(mac); i++) {
+		hash = (hash ^ mac[i]) * 16777619u;
+	}
+
+	int64_t window = (int64_t)SLEEP_SCHED_JITTER_WINDOW_S * 1000000LL;
+	if (window > period) {
+		window = period;
+	}
+	return (int64_t)(hash % 1000000u) * window / 1000000LL;
+}
+
+static void sched_set_cadence(uint32_t *sample_period_s, uint32_t *upload_every) {
+	if (*sample_period_s == 0) {
+		*sample_period_s = SLEEP_SCHED_DEFAULT_PERIOD_S;
+	}
+	if (*upload_every == 0) {
+		*upload_every = 1;
+	} else if (*upload_every > SAMPLE_BUF_LEN) {
+		*upload_every = SAMPLE_BUF_LEN;
+	}
+	period_us = (int64_t)*sample_period_s * 1000000LL;
+	phase_us = device_phase_us(period_us);
+	upload_cadence = *upload_every;
+}
+
+//sampling is false on a boot that goes straight back to deep sleep without a sample
+void sleep_sched_init(uint32_t sample_period_s, uint32_t upload_every, bool sampling) {
+	sched_set_cadence(&sample_period_s, &upload_every);
+
+	timer_wake = (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER);
+	if (sched_state.magic != SLEEP_SCHED_MAGIC) {
+		sched_state.magic = SLEEP_SCHED_MAGIC;
+		sched_state.next_wake_us = 0;
+		sched_state.samples_pending = 0;
+		timer_wake = false;
+	}
+
+	//every full wake takes one sample, plus the ones the wake stub took since the last full boot
+	sched_state.samples_pending += wake_stub_collect() + (sampling ? 1 : 0);
+
+	wake_latency_us = 0;
+	if (timer_wake && sched_state.next_wake_us != 0) {
+		wake_latency_us = sched_now_us() - sched_state.next_wake_us;
+	}
+	ESP_LOGI(TAG_SLEEP, "period %" PRIu32 " s, upload every %" PRIu32 " samples, phase %lld ms, %" PRIu32 " samples pending, woke %lld ms after schedule",
+			sample_period_s, upload_every, phase_us / 1000, sched_state.samples_pending, wake_latency_us / 1000);
+}
+
+//for the next deep sleep, e.g. when the battery policy changed its mind during the wake
+void sleep_sched_set_cadence(uint32_t sample_period_s, uint32_t upload_every) {
+	if (sample_period_s == period_us / 1000000LL && upload_every == upload_cadence) {
+		return;
+	}
+	sched_set_cadence(&sample_period_s, &upload_every);
+	ESP_LOGI(TAG_SLEEP, "period %" PRIu32 " s, upload every %" PRIu32 " samples from the next sleep", sample_period_s, upload_every);
+}
+
+//uploads happen every upload_every samples and on any wake that is not from the timer (power on, reset)
+bool sleep_sched_upload_due(void) {
+	return !timer_wake || sched_state.samples_pending >= upload_cadence;
+}
+
+void sleep_sched_upload_done(bool success) {
+	if (success) {
+		sched_state.samples_pending = 0;
+	}
+}
+
+//time from the scheduled wake to sleep_sched_init, covers ROM, bootloader and app start
+int64_t sleep_sched_wake_latency_us(void) {
+	return wake_latency_us;
+}
+
+void sleep_sched_enter_deep_sleep(void) {
+	int64_t now = sched_now_us();
+	int64_t earliest = now + (int64_t)SLEEP_SCHED_MIN_SLEEP_MS * 1000LL;
+
+	//next grid point phase + k*period after earliest, the time already spent awake is not added on top
+	int64_t next_wake = phase_us + (floor_div(earliest - phase_us, period_us) + 1) * period_us;
+
+	if (sched_state.next_wake_us != 0 && next_wake - sched_state.next_wake_us > period_us) {
+		ESP_LOGW(TAG_SLEEP, "missed %lld wake slots", (next_wake - sched_state.next_wake_us) / period_us - 1);
+	}
+
+	//the sample-only wakes before the next upload are served by the wake stub without a full boot
+	uint64_t sleep_us = (uint64_t)(next_wake - now);
+	uint32_t stub_wakes = (sched_state.samples_pending < upload_cadence) ? upload_cadence - sched_state.samples_pending - 1 : 0;
+	wake_stub_arm(stub_wakes, (uint64_t)next_wake, sleep_us, (uint32_t)(period_us / 1000000LL));
+	sched_state.next_wake_us = next_wake + stub_wakes * period_us;
+
+	printf("Entering deep sleep for %llu s\n", sleep_us / 1000000ULL);
+
+	esp_sleep_enable_timer_wakeup(sleep_us);
+	wake_prof_commit();
+	esp_deep_sleep_start();
+}
+
+//grid and pending samples, saved by app_image.c before the restart into the other image
+void *sleep_sched_rtc_state(size_t *len) {
+	*len = sizeof(sched_state);
+	return &sched_state;
+}
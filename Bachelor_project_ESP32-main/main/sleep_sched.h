@@ -0,0 +1,29 @@
+/*
+ * sleep_sched.h
+ *
+ *  Deep sleep scheduler. Wakes are aligned to a fixed grid of sample periods on the system
+ *  clock (which keeps running in deep sleep) with a per-device phase offset, so the time
+ *  spent awake does not accumulate as drift and a fleet does not wake in the same second.
+ *  Sample-only wakes between uploads are handed to the wake stub (wake_stub.c).
+ */
+
+#ifndef MAIN_SLEEP_SCHED_H_
+#define MAIN_SLEEP_SCHED_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLEEP_SCHED_DEFAULT_PERIOD_S 600		// used when the timer is not configured
+#define SLEEP_SCHED_JITTER_WINDOW_S 60			// phase offsets are spread over this window
+#define SLEEP_SCHED_MIN_SLEEP_MS 1000			// a wake slot closer than this is skipped
+
+void sleep_sched_init(uint32_t sample_period_s, uint32_t upload_every, bool sampling);
+void sleep_sched_set_cadence(uint32_t sample_period_s, uint32_t upload_every);
+bool sleep_sched_upload_due(void);
+void sleep_sched_upload_done(bool success);
+int64_t sleep_sched_wake_latency_us(void);
+void sleep_sched_enter_deep_sleep(void);
+void *sleep_sched_rtc_state(size_t *len);
+
+#endif /* MAIN_SLEEP_SCHED_H_ */
@@ -0,0 +1,396 @@
+/*
+ * uplink.c
+ *
+ *  The warm-up task resolves the server from the uri and opens the TCP connection while
+ *  the payload is still being prepared, uplink_post then only has to write the request.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "uplink.h"
+#include "wifi.h"
+#include "app_config.h"
+#include "mem_stats.h"
+
+#define TAG_UPLINK "UPLINK"
+
+#define UPLINK_HOST_MAX_LEN 64
+#define UPLINK_PATH_MAX_LEN 192
+#define UPLINK_DEFAULT_PORT 80
+#define UPLINK_IO_TIMEOUT_S 5
+
+#define UPLINK_DONE_BIT BIT0
+
+//request() results below 0
+#define UPLINK_NOT_SENT -1			// the request was not written completely
+#define UPLINK_CLOSED -2			// the server closed the connection without a reply byte
+#define UPLINK_NO_REPLY -3			// the request was written, the reply did not come or was cut off
+
+//resolved address of the upload server, kept in RTC memory so later wakes skip DNS
+typedef struct {
+	char host[UPLINK_HOST_MAX_LEN];
+	uint16_t port;
+	uint32_t addr;				// IPv4 address in network byte order, 0 if invalid
+	time_t expires;				// system time, which keeps running through deep sleep
+} uplink_dns_cache_t;
+
+RTC_DATA_ATTR static uplink_dns_cache_t dns_cache;
+
+static char host[UPLINK_HOST_MAX_LEN];
+static char path[UPLINK_PATH_MAX_LEN];
+static uint16_t port;
+
+static EventGroupHandle_t uplink_event_group = NULL;
+static StaticEventGroup_t uplink_event_group_buffer;
+
+//the warm-up task is created once and waits for a notification, it never deletes itself
+static TaskHandle_t uplink_task_handle = NULL;
+static StackType_t uplink_task_stack[UPLINK_TASK_STACK_SIZE];
+static StaticTask_t uplink_task_tcb;
+static volatile int warm_sock = -1;
+static volatile bool warmup_running = false;
+static bool warm_sock_reused = false;			// the connection already carried a request
+static bool uplink_persistent = false;			// reopen the connection when the server closed it
+
+//split the uri ("host[:port][/path]") into its parts
+static bool parse_uri(void) {
+	const char *p = app_config.uri;
+	size_t host_len = strcspn(p, ":/");
+	if (host_len == 0 || host_len >= sizeof(host)) {
+		ESP_LOGE(TAG_UPLINK, "invalid uri: %s", app_config.uri);
+		return false;
+	}
+	memcpy(host, p, host_len);
+	host[host_len] = '\0';
+	p += host_len;
+
+	port = UPLINK_DEFAULT_PORT;
+	if (*p == ':') {
+		char *end;
+		port = (uint16_t)strtoul(p + 1, &end, 10);
+		p = end;
+	}
+	snprintf(path, sizeof(path), "%s", (*p == '/') ? p : "/");
+	return true;
+}
+
+static bool resolve_host(uint32_t *addr, bool *from_cache) {
+	time_t now = time(NULL);
+	if (dns_cache.addr != 0 && dns_cache.port == port && now < dns_cache.expires
+			&& strcmp(dns_cache.host, host) == 0) {
+		*addr = dns_cache.addr;
+		*from_cache = true;
+		return true;
+	}
+
+	struct addrinfo hints = {
+			.ai_family = AF_INET,
+			.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res = NULL;
+	int err = getaddrinfo(host, NULL, &hints, &res);
+	if (err != 0 || res == NULL) {
+		ESP_LOGE(TAG_UPLINK, "DNS lookup of %s failed: %d", host, err);
+		return false;
+	}
+	*addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(res);
+
+	strcpy(dns_cache.host, host);
+	dns_cache.port = port;
+	dns_cache.addr = *addr;
+	dns_cache.expires = now + UPLINK_DNS_TTL_S;
+	*from_cache = false;
+	return true;
+}
+
+//non-blocking connect so a dead server costs UPLINK_CONNECT_TIMEOUT_MS and not the lwIP SYN retries
+static int connect_to(uint32_t addr) {
+	int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		return -1;
+	}
+
+	struct sockaddr_in dest = {
+			.sin_family = AF_INET,
+			.sin_port = htons(port),
+			.sin_addr.s_addr = addr,
+	};
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+	int ret = connect(sock, (struct sockaddr *)&dest, sizeof(dest));
+	if (ret < 0 && errno != EINPROGRESS) {
+		close(sock);
+		return -1;
+	}
+	if (ret < 0) {
+		fd_set wfds;
+		FD_ZERO(&wfds);
+		FD_SET(sock, &wfds);
+		struct timeval tv = {
+				.tv_sec = UPLINK_CONNECT_TIMEOUT_MS / 1000,
+				.tv_usec = (UPLINK_CONNECT_TIMEOUT_MS % 1000) * 1000,
+		};
+		int so_error = 0;
+		socklen_t len = sizeof(so_error);
+		ret = select(sock + 1, NULL, &wfds, NULL, &tv);
+		if (ret <= 0 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0 || so_error != 0) {
+			close(sock);
+			return -1;
+		}
+	}
+
+	fcntl(sock, F_SETFL, flags);
+	struct timeval io_timeout = { .tv_sec = UPLINK_IO_TIMEOUT_S };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+	return sock;
+}
+
+static void uplink_warmup(void) {
+	int64_t start_us = esp_timer_get_time();
+	uint32_t addr;
+	bool from_cache = false;
+	int sock = -1;
+
+	if (parse_uri() && resolve_host(&addr, &from_cache)) {
+		int64_t resolved_us = esp_timer_get_time();
+		sock = connect_to(addr);
+		if (sock < 0 && from_cache) {
+			//the cached address may be stale, look it up again once
+			dns_cache.addr = 0;
+			if (resolve_host(&addr, &from_cache)) {
+				sock = connect_to(addr);
+			}
+		}
+		ESP_LOGI(TAG_UPLINK, "warm-up %s:%u, dns %lld ms (%s), connect %s after %lld ms", host, port,
+				(resolved_us - start_us) / 1000, from_cache ? "cached" : "lookup",
+				(sock >= 0) ? "ok" : "failed", (esp_timer_get_time() - resolved_us) / 1000);
+	}
+
+	warm_sock = sock;
+	warm_sock_reused = false;
+	warmup_running = false;
+	xEventGroupSetBits(uplink_event_group, UPLINK_DONE_BIT);
+}
+
+static void uplink_warmup_task(void *ignore) {
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		uplink_warmup();
+		mem_stats_task(NULL);
+	}
+}
+
+//called from IP_EVENT_STA_GOT_IP, runs DNS and the TCP handshake in the background
+void uplink_warmup_start(void) {
+	if (uplink_event_group == NULL) {
+		uplink_event_group = xEventGroupCreateStatic(&uplink_event_group_buffer);
+		uplink_task_handle = xTaskCreateStatic(&uplink_warmup_task, "uplink_warmup_task", UPLINK_TASK_STACK_SIZE, NULL, 5,
+				uplink_task_stack, &uplink_task_tcb);
+	}
+	if (warmup_running || warm_sock >= 0) {
+		return;
+	}
+
+	warmup_running = true;
+	xEventGroupClearBits(uplink_event_group, UPLINK_DONE_BIT);
+	xTaskNotifyGive(uplink_task_handle);
+}
+
+static void uplink_reconnect(void) {
+	uint32_t addr;
+	bool from_cache;
+	if (warm_sock >= 0) {
+		close(warm_sock);
+	}
+	warm_sock = resolve_host(&addr, &from_cache) ? connect_to(addr) : -1;
+	warm_sock_reused = false;
+}
+
+static bool send_all(int sock, const char *data, size_t len) {
+	while (len > 0) {
+		int n = send(sock, data, len, 0);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+//reads the status line and headers and drains the body, returns the status code, UPLINK_CLOSED or UPLINK_NO_REPLY
+static int read_response(int sock, bool *keep_open) {
+	char buf[512];
+	size_t len = 0;
+	char *hdr_end = NULL;
+
+	*keep_open = true;
+	while (hdr_end == NULL) {
+		if (len == sizeof(buf) - 1) {
+			//headers larger than the buffer, take the status and let the server close
+			*keep_open = false;
+			break;
+		}
+		int n = recv(sock, buf + len, sizeof(buf) - 1 - len, 0);
+		if (n == 0 && len == 0) {
+			return UPLINK_CLOSED;
+		}
+		if (n <= 0) {
+			return UPLINK_NO_REPLY;
+		}
+		len += n;
+		buf[len] = '\0';
+		hdr_end = strstr(buf, "\r\n\r\n");
+	}
+
+	int code = 0;
+	if (sscanf(buf, "HTTP/%*s %d", &code) != 1) {
+		return UPLINK_NO_REPLY;
+	}
+	if (strncmp(buf, "HTTP/1.0", 8) == 0) {
+		*keep_open = false;
+	}
+	if (hdr_end == NULL) {
+		return code;
+	}
+
+	long content_length = -1;
+	for (char *line = strstr(buf, "\r\n"); line != NULL && line < hdr_end; line = strstr(line + 2, "\r\n")) {
+		char *field = line + 2;
+		if (strncasecmp(field, "Content-Length:", 15) == 0) {
+			content_length = strtol(field + 15, NULL, 10);
+		} else if (strncasecmp(field, "Connection: close", 17) == 0) {
+			*keep_open = false;
+		}
+	}
+	if (content_length < 0) {
+		//chunked or close-delimited body, not worth parsing for a status reply
+		*keep_open = false;
+		return code;
+	}
+
+	long remaining = content_length - (long)(len - (hdr_end + 4 - buf));
+	while (remaining > 0 && *keep_open) {
+		int n = recv(sock, buf, (remaining < sizeof(buf)) ? remaining : sizeof(buf), 0);
+		if (n <= 0) {
+			*keep_open = false;
+			break;
+		}
+		remaining -= n;
+	}
+	return code;
+}
+
+//sends one request and reads the reply, returns the status code or one of the UPLINK_ errors above
+static int request(int sock, const char *header, size_t header_len, const char *body, size_t body_len, bool *keep_open) {
+	*keep_open = false;
+	if (!send_all(sock, header, header_len) || !send_all(sock, body, body_len)) {
+		return UPLINK_NOT_SENT;
+	}
+	return read_response(sock, keep_open);
+}
+
+/*
+ * POST the form body over the warmed-up connection. The connection is kept open when the
+ * server allows it, so buffered samples go out back to back; call uplink_close when done.
+ * ESP_ERR_INVALID_STATE: no connection was warmed up, ESP_FAIL: the request did not reach the server,
+ * ESP_ERR_TIMEOUT: the request was sent but no reply came, the server may have stored it,
+ * ESP_ERR_INVALID_RESPONSE: the server answered with a non 2xx status.
+ */
+esp_err_t uplink_post(const char *body, size_t body_len, TickType_t timeout) {
+	if (uplink_event_group == NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	EventBits_t bits = xEventGroupWaitBits(uplink_event_group, UPLINK_DONE_BIT, pdFALSE, pdTRUE, timeout);
+	if (!(bits & UPLINK_DONE_BIT)) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (warm_sock < 0 && uplink_persistent && host[0] != '\0') {
+		//continuous mode, the server closed the last connection, reopen it to the cached address
+		uplink_reconnect();
+	}
+	if (warm_sock < 0) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	char host_header[UPLINK_HOST_MAX_LEN + 8];
+	if (port == UPLINK_DEFAULT_PORT) {
+		snprintf(host_header, sizeof(host_header), "%s", host);
+	} else {
+		snprintf(host_header, sizeof(host_header), "%s:%u", host, port);
+	}
+
+	char header[UPLINK_PATH_MAX_LEN + UPLINK_HOST_MAX_LEN + 160];
+	int header_len = snprintf(header, sizeof(header),
+			"POST %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Content-Type: application/x-www-form-urlencoded\r\n"
+			"Content-Length: %u\r\n\r\n",
+			path, host_header, (unsigned)body_len);
+	if (header_len <= 0 || header_len >= sizeof(header)) {
+		return ESP_FAIL;
+	}
+
+	bool keep_open;
+	int code = request(warm_sock, header, header_len, body, body_len, &keep_open);
+	if ((code == UPLINK_NOT_SENT || code == UPLINK_CLOSED) && warm_sock_reused) {
+		//the server closed the idle keep-alive connection, reconnect once to the cached address
+		uplink_reconnect();
+		if (warm_sock >= 0) {
+			code = request(warm_sock, header, header_len, body, body_len, &keep_open);
+		}
+	}
+
+	if (keep_open && warm_sock >= 0) {
+		warm_sock_reused = true;
+	} else {
+		uplink_close();
+	}
+
+	if (code == UPLINK_NO_REPLY) {
+		ESP_LOGE(TAG_UPLINK, "no reply after the request was sent");
+		return ESP_ERR_TIMEOUT;
+	}
+	if (code < 0) {
+		return ESP_FAIL;
+	}
+	if (code < 200 || code >= 300) {
+		ESP_LOGE(TAG_UPLINK, "server replied with status %d", code);
+		return ESP_ERR_INVALID_RESPONSE;
+	}
+	return ESP_OK;
+}
+
+//continuous mode keeps one connection to the server open for all samples
+void uplink_set_persistent(bool persistent) {
+	uplink_persistent = persistent;
+}
+
+void uplink_close(void) {
+	if (warm_sock >= 0) {
+		close(warm_sock);
+		warm_sock = -1;
+	}
+	warm_sock_reused = false;
+}
+
+//the other image starts with this DNS cache instead of resolving again
+void *uplink_rtc_state(size_t *len) {
+	*len = sizeof(dns_cache);
+	return &dns_cache;
+}
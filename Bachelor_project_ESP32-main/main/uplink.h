@@ -0,0 +1,27 @@
+/*
+ * uplink.h
+ *
+ *  Warm-up of the connection to the upload server: DNS lookup (cached in RTC memory)
+ *  and TCP connect are started as soon as the station gets an IP.
+ */
+
+#ifndef MAIN_UPLINK_H_
+#define MAIN_UPLINK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#define UPLINK_DNS_TTL_S 3600				// lwIP does not expose the record TTL, cached addresses expire after this
+#define UPLINK_CONNECT_TIMEOUT_MS 3000		// TCP handshake timeout for the pre-connect
+#define UPLINK_WARMUP_TIMEOUT_MS 5000		// how long send_data_http waits for the warm-up to finish
+#define UPLINK_TASK_STACK_SIZE 4096			// bytes, getaddrinfo and connect run on it
+
+void uplink_warmup_start(void);
+esp_err_t uplink_post(const char *body, size_t body_len, TickType_t timeout);
+void uplink_set_persistent(bool persistent);
+void uplink_close(void);
+void *uplink_rtc_state(size_t *len);
+
+#endif /* MAIN_UPLINK_H_ */
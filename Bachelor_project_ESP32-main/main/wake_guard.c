@@ -0,0 +1,206 @@
+/*
+ * wake_guard.c
+ *
+ *  One esp_timer is armed for the earliest deadline of the running phases and the whole
+ *  wake. The phases are the ones wake_prof measures, wake_prof_begin/end report them here.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "wake_guard.h"
+#include "app_fsm.h"
+#include "sleep_sched.h"
+
+#define TAG_GUARD "WAKE_GUARD"
+
+#define WAKE_GUARD_MAGIC 0x47524431
+#define WAKE_GUARD_TOTAL WAKE_PROF_COUNT	// overrun slot of the whole wake budget
+
+//overruns since power on and what the last cut off wake was doing
+typedef struct {
+	uint32_t magic;
+	uint16_t overruns[WAKE_PROF_COUNT + 1];
+	uint8_t last_phase;
+	uint8_t last_state;						// app_state_t when it was cut off
+	uint32_t last_elapsed_ms;				// time in the phase, or since boot for the total budget
+	bool last_reported;						// logged at the boot after the overrun
+} wake_guard_stats_t;
+
+RTC_DATA_ATTR static wake_guard_stats_t guard_stats;
+
+//0 for phases without a budget
+static const uint32_t phase_budget_ms[WAKE_PROF_COUNT] = {
+		[WAKE_PROF_NVS] = WAKE_GUARD_NVS_MS,
+		[WAKE_PROF_WIFI] = WAKE_GUARD_WIFI_MS,
+		[WAKE_PROF_BME280] = WAKE_GUARD_SENSOR_MS,
+		[WAKE_PROF_MAX17048] = WAKE_GUARD_SENSOR_MS,
+		[WAKE_PROF_HTTP] = WAKE_GUARD_HTTP_MS,
+		[WAKE_PROF_SLEEP] = WAKE_GUARD_SLEEP_MS,
+};
+
+static esp_timer_handle_t guard_timer = NULL;
+static bool guard_active = false;
+static int64_t phase_start_us[WAKE_PROF_COUNT];		// 0 when the phase is not running
+static int64_t guard_start_us;							// the total budget runs from here
+static wake_guard_rescue_t guard_rescue = NULL;
+static portMUX_TYPE guard_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void guard_stats_init(void) {
+	if (guard_stats.magic != WAKE_GUARD_MAGIC) {
+		memset(&guard_stats, 0, sizeof(guard_stats));
+		guard_stats.last_reported = true;
+		guard_stats.magic = WAKE_GUARD_MAGIC;
+	}
+}
+
+//call with guard_lock held
+static void guard_arm(void) {
+	int64_t deadline = guard_start_us + (int64_t)WAKE_GUARD_TOTAL_MS * 1000;
+	for (int i = 0; i < WAKE_PROF_COUNT; i++) {
+		if (phase_start_us[i] != 0 && phase_budget_ms[i] != 0) {
+			int64_t phase_deadline = phase_start_us[i] + (int64_t)phase_budget_ms[i] * 1000;
+			deadline = (phase_deadline < deadline) ? phase_deadline : deadline;
+		}
+	}
+	int64_t timeout = deadline - esp_timer_get_time();
+	esp_timer_stop(guard_timer);
+	esp_timer_start_once(guard_timer, timeout > 0 ? timeout : 1);
+}
+
+static void guard_timer_callback(void *arg) {
+	int64_t now = esp_timer_get_time();
+	int overrun = WAKE_GUARD_TOTAL;
+	int64_t elapsed_us = now - guard_start_us;
+
+	portENTER_CRITICAL(&guard_lock);
+	if (!guard_active) {
+		portEXIT_CRITICAL(&guard_lock);
+		return;
+	}
+	for (int i = 0; i < WAKE_PROF_COUNT; i++) {
+		if (phase_start_us[i] != 0 && phase_budget_ms[i] != 0 && now - phase_start_us[i] >= (int64_t)phase_budget_ms[i] * 1000) {
+			overrun = i;
+			elapsed_us = now - phase_start_us[i];
+			break;
+		}
+	}
+	if (overrun == WAKE_GUARD_TOTAL && elapsed_us < (int64_t)WAKE_GUARD_TOTAL_MS * 1000) {
+		//a phase ended between arming and firing, wait for the next deadline
+		guard_arm();
+		portEXIT_CRITICAL(&guard_lock);
+		return;
+	}
+	guard_active = false;
+	portEXIT_CRITICAL(&guard_lock);
+
+	guard_stats.overruns[overrun]++;
+	guard_stats.last_phase = overrun;
+	guard_stats.last_state = app_fsm_state();
+	guard_stats.last_elapsed_ms = elapsed_us / 1000;
+	guard_stats.last_reported = false;
+	ESP_LOGE(TAG_GUARD, "%s over budget after %lld ms, forcing deep sleep",
+			overrun == WAKE_GUARD_TOTAL ? "wake" : wake_prof_phase_name(overrun), elapsed_us / 1000);
+
+	if (overrun != WAKE_GUARD_TOTAL) {
+		wake_prof_end(overrun);
+	}
+	if (guard_rescue != NULL) {
+		guard_rescue();
+	}
+	//the upload was not confirmed, the next wake uploads again
+	sleep_sched_enter_deep_sleep();
+}
+
+//arms the total budget from now, at boot and again when the user leaves provisioning on a battery wake.
+//Only phases begun after this are held to their budget. rescue runs on the esp_timer task right
+//before the forced deep sleep, the main task may be stuck anywhere, so it must only touch RTC memory.
+void wake_guard_start(wake_guard_rescue_t rescue) {
+	guard_stats_init();
+	if (!guard_stats.last_reported) {
+		ESP_LOGW(TAG_GUARD, "last overrun: %s in state %u after %lu ms",
+				guard_stats.last_phase == WAKE_GUARD_TOTAL ? "wake" : wake_prof_phase_name(guard_stats.last_phase),
+				guard_stats.last_state, (unsigned long)guard_stats.last_elapsed_ms);
+		guard_stats.last_reported = true;
+	}
+
+	if (guard_timer == NULL) {
+		const esp_timer_create_args_t timer_args = {
+				.callback = guard_timer_callback,
+				.name = "wake_guard",
+		};
+		ESP_ERROR_CHECK(esp_timer_create(&timer_args, &guard_timer));
+	}
+	guard_rescue = rescue;
+	portENTER_CRITICAL(&guard_lock);
+	memset(phase_start_us, 0, sizeof(phase_start_us));
+	guard_start_us = esp_timer_get_time();
+	guard_active = true;
+	guard_arm();
+	portEXIT_CRITICAL(&guard_lock);
+}
+
+//after a provisioning fallback that timed out, the wake keeps the deadline from wake_guard_start.
+//Phases begun while stopped are not held to their budget, the total deadline may already be past.
+void wake_guard_resume(void) {
+	if (guard_timer == NULL) {
+		return;
+	}
+	portENTER_CRITICAL(&guard_lock);
+	memset(phase_start_us, 0, sizeof(phase_start_us));
+	guard_active = true;
+	guard_arm();
+	portEXIT_CRITICAL(&guard_lock);
+}
+
+//provisioning and continuous mode are not bounded
+void wake_guard_stop(void) {
+	portENTER_CRITICAL(&guard_lock);
+	guard_active = false;
+	if (guard_timer != NULL) {
+		esp_timer_stop(guard_timer);
+	}
+	portEXIT_CRITICAL(&guard_lock);
+}
+
+void wake_guard_phase_begin(wake_prof_phase_t phase) {
+	portENTER_CRITICAL(&guard_lock);
+	phase_start_us[phase] = esp_timer_get_time();
+	if (guard_active && phase_budget_ms[phase] != 0) {
+		guard_arm();
+	}
+	portEXIT_CRITICAL(&guard_lock);
+}
+
+//the timer stays armed for the old deadline, the callback re-arms it when nothing overran
+void wake_guard_phase_end(wake_prof_phase_t phase) {
+	portENTER_CRITICAL(&guard_lock);
+	phase_start_us[phase] = 0;
+	portEXIT_CRITICAL(&guard_lock);
+}
+
+//"&overrun=phase:count,..." since power on, nothing when no wake was cut off
+size_t wake_guard_format(char *buf, size_t len) {
+	size_t pos = 0;
+
+	guard_stats_init();
+	buf[0] = '\0';
+	for (int i = 0; i <= WAKE_GUARD_TOTAL && pos < len; i++) {
+		if (guard_stats.overruns[i] == 0) {
+			continue;
+		}
+		pos += snprintf(buf + pos, len - pos, "%s%s:%u", pos == 0 ? "&overrun=" : ",",
+				i == WAKE_GUARD_TOTAL ? "wake" : wake_prof_phase_name(i), guard_stats.overruns[i]);
+	}
+	return pos < len ? pos : len - 1;
+}
+
+//overrun counts, for the image switch in app_image.c
+void *wake_guard_rtc_state(size_t *len) {
+	*len = sizeof(guard_stats);
+	return &guard_stats;
+}
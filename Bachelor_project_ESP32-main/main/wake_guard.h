@@ -0,0 +1,33 @@
+/*
+ * wake_guard.h
+ *
+ *  Deadline supervisor for battery wakes. The wake as a whole and each profiled phase get a
+ *  budget, an overrun cuts the wake off from the esp_timer task (the main task may be the
+ *  one that hangs), records it in RTC memory and goes to deep sleep until the next slot.
+ */
+
+#ifndef MAIN_WAKE_GUARD_H_
+#define MAIN_WAKE_GUARD_H_
+
+#include <stddef.h>
+#include "wake_prof.h"
+
+#define WAKE_GUARD_TOTAL_MS 40000			// whole wake from wake_guard_start, above the cancel window after the upload
+#define WAKE_GUARD_NVS_MS 3000				// nvs_flash_init, longer only when it has to erase
+#define WAKE_GUARD_WIFI_MS 15000			// WiFi start to got IP, the FSM gives up after WIFI_CONNECT_TIMEOUT
+#define WAKE_GUARD_SENSOR_MS 6000			// first sample of each reader, the FSM moves on after SENSOR_READY_TIMEOUT
+#define WAKE_GUARD_HTTP_MS 20000			// all posts, warm-up wait plus the esp_http_client fallback
+#define WAKE_GUARD_SLEEP_MS 3000			// SLEEP entered to esp_deep_sleep_start
+#define WAKE_GUARD_FORM_LEN 96				// longest form fields wake_guard_format writes
+
+typedef void (*wake_guard_rescue_t)(void);
+
+void wake_guard_start(wake_guard_rescue_t rescue);
+void wake_guard_resume(void);
+void wake_guard_stop(void);
+void wake_guard_phase_begin(wake_prof_phase_t phase);
+void wake_guard_phase_end(wake_prof_phase_t phase);
+size_t wake_guard_format(char *buf, size_t len);
+void *wake_guard_rtc_state(size_t *len);
+
+#endif /* MAIN_WAKE_GUARD_H_ */
@@ -0,0 +1,144 @@
+/*
+ * wake_prof.c
+ *
+ *  Phases are timed with esp_timer_get_time and stored in milliseconds as 16 bit values,
+ *  one record is WAKE_PROF_COUNT * 2 bytes of RTC memory. The history is cleared when a
+ *  different firmware boots, so the statistics always belong to the version reported.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_app_desc.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "wake_prof.h"
+#include "wake_guard.h"
+
+#define TAG_PROF "WAKE_PROF"
+
+#define WAKE_PROF_MAGIC 0x50524F46
+#define WAKE_PROF_NOT_RUN 0xFFFF
+#define WAKE_PROF_MAX_MS 0xFFFE
+
+typedef struct {
+	uint16_t ms[WAKE_PROF_COUNT];
+} wake_prof_record_t;
+
+typedef struct {
+	uint32_t magic;
+	uint8_t elf_sha[4];						// first bytes of the app ELF hash the history belongs to
+	uint8_t head;							// next record to write
+	uint8_t count;
+	wake_prof_record_t records[WAKE_PROF_HISTORY];
+} wake_prof_history_t;
+
+RTC_DATA_ATTR static wake_prof_history_t history;
+
+static const char *phase_names[WAKE_PROF_COUNT] = {
+		[WAKE_PROF_BOOT] = "boot",
+		[WAKE_PROF_NVS] = "nvs",
+		[WAKE_PROF_WIFI] = "wifi",
+		[WAKE_PROF_BME280] = "bme280",
+		[WAKE_PROF_MAX17048] = "max17048",
+		[WAKE_PROF_HTTP] = "http",
+		[WAKE_PROF_SLEEP] = "sleep",
+};
+
+//this wake, begin timestamps and the record committed before deep sleep
+static int64_t phase_start_us[WAKE_PROF_COUNT];
+static wake_prof_record_t current = { .ms = {
+		WAKE_PROF_NOT_RUN, WAKE_PROF_NOT_RUN, WAKE_PROF_NOT_RUN, WAKE_PROF_NOT_RUN,
+		WAKE_PROF_NOT_RUN, WAKE_PROF_NOT_RUN, WAKE_PROF_NOT_RUN } };
+_Static_assert(WAKE_PROF_COUNT == 7, "initialise current for every phase");
+
+static void history_check(void) {
+	const esp_app_desc_t *desc = esp_app_get_description();
+	if (history.magic == WAKE_PROF_MAGIC && memcmp(history.elf_sha, desc->app_elf_sha256, sizeof(history.elf_sha)) == 0) {
+		return;
+	}
+	memset(&history, 0, sizeof(history));
+	memcpy(history.elf_sha, desc->app_elf_sha256, sizeof(history.elf_sha));
+	history.magic = WAKE_PROF_MAGIC;
+}
+
+//the wake guard holds every phase to its budget
+void wake_prof_begin(wake_prof_phase_t phase) {
+	phase_start_us[phase] = esp_timer_get_time();
+	wake_guard_phase_begin(phase);
+}
+
+//a phase that was not begun is ignored, so ends on repeated events are harmless
+void wake_prof_end_at(wake_prof_phase_t phase, int64_t time_us) {
+	if (phase_start_us[phase] == 0) {
+		return;
+	}
+	wake_prof_set(phase, time_us - phase_start_us[phase]);
+	phase_start_us[phase] = 0;
+	wake_guard_phase_end(phase);
+}
+
+void wake_prof_end(wake_prof_phase_t phase) {
+	wake_prof_end_at(phase, esp_timer_get_time());
+}
+
+//a phase that did not complete, e.g. a sensor that never answered, is not recorded
+void wake_prof_cancel(wake_prof_phase_t phase) {
+	phase_start_us[phase] = 0;
+	wake_guard_phase_end(phase);
+}
+
+//durations measured elsewhere, e.g. the wake latency from the sleep scheduler
+void wake_prof_set(wake_prof_phase_t phase, int64_t duration_us) {
+	int64_t ms = duration_us / 1000;
+	if (ms < 0) {
+		ms = 0;
+	}
+	current.ms[phase] = (ms > WAKE_PROF_MAX_MS) ? WAKE_PROF_MAX_MS : (uint16_t)ms;
+}
+
+const char *wake_prof_phase_name(wake_prof_phase_t phase) {
+	return phase_names[phase];
+}
+
+//store this wake, called right before esp_deep_sleep_start
+void wake_prof_commit(void) {
+	wake_prof_end(WAKE_PROF_SLEEP);
+	history_check();
+	history.records[history.head] = current;
+	history.head = (history.head + 1) % WAKE_PROF_HISTORY;
+	if (history.count < WAKE_PROF_HISTORY) {
+		history.count++;
+	}
+}
+
+//"&fw=<version>&prof=phase:min/mean/max,..." in ms over the stored wakes, phases that never ran are left out
+size_t wake_prof_format(char *buf, size_t len) {
+	size_t pos = 0;
+	bool first = true;
+
+	history_check();
+	pos += snprintf(buf, len, "&fw=%s", esp_app_get_description()->version);
+	for (int phase = 0; phase < WAKE_PROF_COUNT && pos < len; phase++) {
+		uint32_t min = UINT32_MAX, max = 0, sum = 0, n = 0;
+		for (int i = 0; i < history.count; i++) {
+			uint16_t ms = history.records[i].ms[phase];
+			if (ms == WAKE_PROF_NOT_RUN) {
+				continue;
+			}
+			min = (ms < min) ? ms : min;
+			max = (ms > max) ? ms : max;
+			sum += ms;
+			n++;
+		}
+		if (n == 0) {
+			continue;
+		}
+		pos += snprintf(buf + pos, len - pos, "%s%s:%lu/%lu/%lu", first ? "&prof=" : ",", phase_names[phase],
+				(unsigned long)min, (unsigned long)(sum / n), (unsigned long)max);
+		first = false;
+	}
+	ESP_LOGI(TAG_PROF, "%u wakes in the profile", history.count);
+	return pos < len ? pos : len - 1;
+}
@@ -0,0 +1,38 @@
+/*
+ * wake_prof.h
+ *
+ *  Wake cycle profiler. Each full wake records how long its phases took, the last
+ *  WAKE_PROF_HISTORY records are kept in RTC memory and min/mean/max per phase goes out
+ *  with the next upload together with the firmware version.
+ */
+
+#ifndef MAIN_WAKE_PROF_H_
+#define MAIN_WAKE_PROF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAKE_PROF_HISTORY 16				// wakes the statistics are taken over
+#define WAKE_PROF_FORM_LEN 256				// longest form fields wake_prof_format writes
+
+typedef enum {
+	WAKE_PROF_BOOT,							// scheduled wake (or reset) to app_main, includes ROM and bootloader
+	WAKE_PROF_NVS,							// nvs_flash_init, only on wakes that need flash
+	WAKE_PROF_WIFI,							// WiFi start to got IP
+	WAKE_PROF_BME280,						// reader start to the first compensated sample
+	WAKE_PROF_MAX17048,						// reader start to the first state of charge
+	WAKE_PROF_HTTP,							// buffered and current sample posts
+	WAKE_PROF_SLEEP,						// SLEEP entered to esp_deep_sleep_start
+	WAKE_PROF_COUNT
+} wake_prof_phase_t;
+
+void wake_prof_begin(wake_prof_phase_t phase);
+void wake_prof_end(wake_prof_phase_t phase);
+void wake_prof_cancel(wake_prof_phase_t phase);
+void wake_prof_end_at(wake_prof_phase_t phase, int64_t time_us);
+void wake_prof_set(wake_prof_phase_t phase, int64_t duration_us);
+void wake_prof_commit(void);
+const char *wake_prof_phase_name(wake_prof_phase_t phase);
+size_t wake_prof_format(char *buf, size_t len);
+
+#endif /* MAIN_WAKE_PROF_H_ */
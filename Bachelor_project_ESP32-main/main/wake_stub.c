@@ -0,0 +1,263 @@
+/*
+ * wake_stub.c
+ *
+ *  Everything called from esp_wake_deep_sleep has to live in RTC memory (RTC_IRAM_ATTR and
+ *  RTC_DATA_ATTR) or in ROM, flash is not mapped yet. The stub therefore drives SDA/SCL as
+ *  open drain through the GPIO registers and uses the ROM delay, and avoids 64-bit division.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_wake_stub.h"
+#include "esp_rom_sys.h"
+#include "soc/rtc.h"
+#include "hal/rtc_cntl_ll.h"
+#include "soc/gpio_reg.h"
+#include "soc/io_mux_reg.h"
+#include "soc/gpio_sig_map.h"
+
+#include "wake_stub.h"
+#include "sample_buf.h"
+
+//same pins and addresses as the I2C driver in main.c, max.c and sensor_func.c
+#define STUB_SDA_PIN 6
+#define STUB_SCL_PIN 7
+#define STUB_SDA_MUX_REG IO_MUX_GPIO6_REG
+#define STUB_SCL_MUX_REG IO_MUX_GPIO7_REG
+#define STUB_BME280_ADDR 0x76
+#define STUB_MAX17048_ADDR 0x36
+
+#define STUB_I2C_HALF_PERIOD_US 5				// about 100 kHz, the bus only has the internal pull-ups
+#define STUB_CONVERSION_TIMEOUT_MS 20			// forced conversion with x1 oversampling takes below 10 ms
+
+//BME280 registers, forced mode with x1 oversampling and the IIR filter off keeps the conversion short
+#define STUB_BME280_CTRL_HUM 0xF2
+#define STUB_BME280_STATUS 0xF3
+#define STUB_BME280_CTRL_MEAS 0xF4
+#define STUB_BME280_CONFIG 0xF5
+#define STUB_BME280_DATA 0xF7
+#define STUB_BME280_OSRS_X1_FORCED ((0x01 << 5) | (0x01 << 2) | 0x01)
+#define STUB_MAX17048_SOC 0x04
+
+typedef struct {
+	uint32_t sample_wakes;					// stub wakes left before the next full boot
+	uint32_t samples_taken;					// stub samples since the last full boot
+	uint64_t next_wake_ticks;				// RTC timer count of the next wake, on the same grid as the scheduler
+	uint64_t period_ticks;
+	uint32_t next_time_s;					// scheduled system time of the next stub sample
+	uint32_t period_s;
+} wake_stub_plan_t;
+
+RTC_DATA_ATTR static wake_stub_plan_t stub_plan;
+
+#if WAKE_STUB_ENABLED
+
+static RTC_IRAM_ATTR void line_release(uint32_t pin) {
+	REG_WRITE(GPIO_ENABLE_W1TC_REG, BIT(pin));
+}
+
+static RTC_IRAM_ATTR void line_low(uint32_t pin) {
+	REG_WRITE(GPIO_ENABLE_W1TS_REG, BIT(pin));
+}
+
+static RTC_IRAM_ATTR uint32_t line_read(uint32_t pin) {
+	return (REG_READ(GPIO_IN_REG) >> pin) & 1;
+}
+
+//open drain emulation: the output latch stays 0, the line is pulled low by enabling the driver
+static RTC_IRAM_ATTR void stub_i2c_init(void) {
+	PIN_FUNC_SELECT(STUB_SDA_MUX_REG, PIN_FUNC_GPIO);
+	PIN_FUNC_SELECT(STUB_SCL_MUX_REG, PIN_FUNC_GPIO);
+	PIN_INPUT_ENABLE(STUB_SDA_MUX_REG);
+	PIN_INPUT_ENABLE(STUB_SCL_MUX_REG);
+	REG_SET_BIT(STUB_SDA_MUX_REG, FUN_PU);
+	REG_SET_BIT(STUB_SCL_MUX_REG, FUN_PU);
+	REG_WRITE(GPIO_FUNC0_OUT_SEL_CFG_REG + STUB_SDA_PIN * 4, SIG_GPIO_OUT_IDX);
+	REG_WRITE(GPIO_FUNC0_OUT_SEL_CFG_REG + STUB_SCL_PIN * 4, SIG_GPIO_OUT_IDX);
+	REG_WRITE(GPIO_OUT_W1TC_REG, BIT(STUB_SDA_PIN) | BIT(STUB_SCL_PIN));
+	line_release(STUB_SDA_PIN);
+	line_release(STUB_SCL_PIN);
+}
+
+static RTC_IRAM_ATTR void scl_release(void) {
+	line_release(STUB_SCL_PIN);
+	//allow the slave to stretch the clock for a short while
+	for (int i = 0; i < 100 && !line_read(STUB_SCL_PIN); i++) {
+		esp_rom_delay_us(1);
+	}
+}
+
+static RTC_IRAM_ATTR void stub_i2c_start(void) {
+	line_release(STUB_SDA_PIN);
+	scl_release();
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	line_low(STUB_SDA_PIN);
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	line_low(STUB_SCL_PIN);
+}
+
+static RTC_IRAM_ATTR void stub_i2c_stop(void) {
+	line_low(STUB_SDA_PIN);
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	scl_release();
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	line_release(STUB_SDA_PIN);
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+}
+
+//returns true when the slave acknowledged the byte
+static RTC_IRAM_ATTR bool stub_i2c_write_byte(uint8_t byte) {
+	for (int bit = 7; bit >= 0; bit--) {
+		if (byte & (1 << bit)) {
+			line_release(STUB_SDA_PIN);
+		} else {
+			line_low(STUB_SDA_PIN);
+		}
+		esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+		scl_release();
+		esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+		line_low(STUB_SCL_PIN);
+	}
+
+	line_release(STUB_SDA_PIN);
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	scl_release();
+	bool ack = (line_read(STUB_SDA_PIN) == 0);
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	line_low(STUB_SCL_PIN);
+	return ack;
+}
+
+static RTC_IRAM_ATTR uint8_t stub_i2c_read_byte(bool ack) {
+	uint8_t byte = 0;
+	line_release(STUB_SDA_PIN);
+	for (int bit = 7; bit >= 0; bit--) {
+		esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+		scl_release();
+		byte |= line_read(STUB_SDA_PIN) << bit;
+		esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+		line_low(STUB_SCL_PIN);
+	}
+
+	if (ack) {
+		line_low(STUB_SDA_PIN);
+	}
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	scl_release();
+	esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+	line_low(STUB_SCL_PIN);
+	line_release(STUB_SDA_PIN);
+	return byte;
+}
+
+static RTC_IRAM_ATTR bool stub_write_reg(uint8_t addr, uint8_t reg, uint8_t value) {
+	stub_i2c_start();
+	bool ok = stub_i2c_write_byte(addr << 1) && stub_i2c_write_byte(reg) && stub_i2c_write_byte(value);
+	stub_i2c_stop();
+	return ok;
+}
+
+static RTC_IRAM_ATTR bool stub_read_regs(uint8_t addr, uint8_t reg, uint8_t *data, int len) {
+	stub_i2c_start();
+	bool ok = stub_i2c_write_byte(addr << 1) && stub_i2c_write_byte(reg);
+	if (ok) {
+		stub_i2c_start();
+		ok = stub_i2c_write_byte((addr << 1) | 1);
+	}
+	if (ok) {
+		for (int i = 0; i < len; i++) {
+			data[i] = stub_i2c_read_byte(i < len - 1);
+		}
+	}
+	stub_i2c_stop();
+	return ok;
+}
+
+static RTC_IRAM_ATTR bool stub_sample(void) {
+	uint8_t data[8];
+
+	stub_i2c_init();
+
+	//the application leaves the BME280 in normal mode with the IIR filter on, config is only writable in sleep mode
+	if (!stub_write_reg(STUB_BME280_ADDR, STUB_BME280_CTRL_MEAS, 0x00)
+			|| !stub_write_reg(STUB_BME280_ADDR, STUB_BME280_CONFIG, 0x00)
+			|| !stub_write_reg(STUB_BME280_ADDR, STUB_BME280_CTRL_HUM, 0x01)
+			|| !stub_write_reg(STUB_BME280_ADDR, STUB_BME280_CTRL_MEAS, STUB_BME280_OSRS_X1_FORCED)) {
+		return false;
+	}
+
+	//status bit 3 is set while the conversion runs
+	int waited_ms = 0;
+	do {
+		esp_rom_delay_us(1000);
+		if (!stub_read_regs(STUB_BME280_ADDR, STUB_BME280_STATUS, data, 1)) {
+			return false;
+		}
+	} while ((data[0] & 0x08) && ++waited_ms < STUB_CONVERSION_TIMEOUT_MS);
+
+	if (!stub_read_regs(STUB_BME280_ADDR, STUB_BME280_DATA, data, 8)) {
+		return false;
+	}
+	int32_t adc_t = ((int32_t)data[3] << 12) | ((int32_t)data[4] << 4) | (data[5] >> 4);
+	uint16_t adc_h = ((uint16_t)data[6] << 8) | data[7];
+
+	uint16_t soc = SAMPLE_SOC_UNKNOWN;
+	if (stub_read_regs(STUB_MAX17048_ADDR, STUB_MAX17048_SOC, data, 2)) {
+		soc = (uint16_t)((((uint32_t)data[0] << 8 | data[1]) * 100) >> 8);
+	}
+
+	sample_buf_push_raw(stub_plan.next_time_s, adc_t, adc_h, soc);
+	return true;
+}
+
+void RTC_IRAM_ATTR esp_wake_deep_sleep(void) {
+	if (stub_plan.sample_wakes == 0 || !(esp_wake_stub_get_wakeup_cause() & RTC_TIMER_TRIG_EN)) {
+		//upload due or woken by something else, continue with the full boot
+		esp_default_wake_deep_sleep();
+		return;
+	}
+
+	if (stub_sample()) {
+		stub_plan.samples_taken++;
+	}
+	stub_plan.next_time_s += stub_plan.period_s;
+	stub_plan.sample_wakes--;
+
+	//absolute wake time, the time spent in the stub does not add up over the stub wakes
+	stub_plan.next_wake_ticks += stub_plan.period_ticks;
+	while (stub_plan.next_wake_ticks <= rtc_cntl_ll_get_rtc_time()) {
+		//the slot already passed, a timer set in the past would never fire
+		stub_plan.next_wake_ticks += stub_plan.period_ticks;
+		stub_plan.next_time_s += stub_plan.period_s;
+		if (stub_plan.sample_wakes > 0) {
+			stub_plan.sample_wakes--;
+		}
+	}
+	rtc_cntl_ll_set_wakeup_timer(stub_plan.next_wake_ticks);
+	esp_wake_stub_sleep(&esp_wake_deep_sleep);
+}
+
+#endif /* WAKE_STUB_ENABLED */
+
+//called before esp_deep_sleep_start with the time to the first wake, the next sample_wakes timer wakes are served by the stub
+void wake_stub_arm(uint32_t sample_wakes, uint64_t first_wake_us, uint64_t first_sleep_us, uint32_t period_s) {
+#if WAKE_STUB_ENABLED
+	uint32_t slow_clk_cal = REG_READ(RTC_SLOW_CLK_CAL_REG);
+	stub_plan.sample_wakes = sample_wakes;
+	stub_plan.next_time_s = (uint32_t)(first_wake_us / 1000000ULL);
+	stub_plan.period_s = period_s;
+	stub_plan.next_wake_ticks = rtc_cntl_ll_get_rtc_time() + rtc_time_us_to_slowclk(first_sleep_us, slow_clk_cal);
+	stub_plan.period_ticks = rtc_time_us_to_slowclk((uint64_t)period_s * 1000000ULL, slow_clk_cal);
+#else
+	stub_plan.sample_wakes = 0;
+#endif
+}
+
+//number of samples the stub appended since the last full boot
+uint32_t wake_stub_collect(void) {
+	uint32_t taken = stub_plan.samples_taken;
+	stub_plan.samples_taken = 0;
+	stub_plan.sample_wakes = 0;
+	return taken;
+}
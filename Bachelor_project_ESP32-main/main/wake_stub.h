@@ -0,0 +1,19 @@
+/*
+ * wake_stub.h
+ *
+ *  Deep sleep wake stub for sample-only wakes. It runs from RTC memory straight after the
+ *  ROM, reads the BME280 and MAX17048 over a bit-banged I2C bus, appends the raw values to
+ *  the RTC sample buffer and goes back to sleep. A full boot only happens when an upload is due.
+ */
+
+#ifndef MAIN_WAKE_STUB_H_
+#define MAIN_WAKE_STUB_H_
+
+#include <stdint.h>
+
+#define WAKE_STUB_ENABLED 1						// 0 boots the full application on every wake
+
+void wake_stub_arm(uint32_t sample_wakes, uint64_t first_wake_us, uint64_t first_sleep_us, uint32_t period_s);
+uint32_t wake_stub_collect(void);
+
+#endif /* MAIN_WAKE_STUB_H_ */
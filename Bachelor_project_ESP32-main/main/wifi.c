@@ -10,30 +10,41 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
-#include "esp_bt.h"
-
-#include "esp_blufi_api.h"
-#include "ble.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 
+#include "wifi.h"
+#include "uplink.h"
+#include "power_mgmt.h"
+#include "app_fsm.h"
+#include "app_config.h"
 
+//the sensing image is built without Bluetooth, BLUFI only exists in the provisioning image
+#if CONFIG_BT_ENABLED
+#include "esp_bt.h"
+#include "esp_blufi_api.h"
 #include "esp_blufi.h"
+#include "ble.h"
+#else
+#define BLE_INFO(fmt, ...)   ESP_LOGI("WiFi", fmt, ##__VA_ARGS__)
+#define BLE_ERROR(fmt, ...)  ESP_LOGE("WiFi", fmt, ##__VA_ARGS__)
+#endif
 
-#define WIFI_CONNECTION_MAXIMUM_RETRY 9
 #define INVALID_REASON                255
 #define INVALID_RSSI                  -128
 
-
-#define ESP_BLUFI_CUSTOM_DATA_MAX_LEN 256 // Maximum length of custom data
-#define MAX_IP_LENGTH 256 // Maximum length of an IP address (including null terminator)
-#define MAX_TIMER_LENGTH 16 // Maximum length of the timer (including null terminator)
-
-
-char name[ESP_BLUFI_CUSTOM_DATA_MAX_LEN + 1];
-char uri[MAX_IP_LENGTH];
-char timer[MAX_TIMER_LENGTH];
+// Bulk configuration custom data message, see README
+#define BULK_CONFIG_MAGIC 0xC0 // first byte, never the start of a "key:value" message
+#define BULK_CONFIG_VERSION 1
+#define BULK_CONFIG_OK 0 // acknowledgement status values
+#define BULK_CONFIG_ERR_FORMAT 1 // bad version, truncated entry or no fields
+#define BULK_CONFIG_ERR_FIELD 2 // unknown, repeated, empty, too long or non numeric field
+#define BULK_CONFIG_ERR_STORAGE 3 // NVS write failed
 
 
+#if CONFIG_BT_ENABLED
 void event_callback(esp_blufi_cb_event_t event, esp_blufi_cb_param_t *param);
+#endif
 
 #define WIFI_LIST_NUM   10
 
@@ -42,6 +53,7 @@ wifi_config_t ap_config;
 
 /* FreeRTOS event group to signal when we are connected & ready to make a request */
 EventGroupHandle_t wifi_event_group;
+static StaticEventGroup_t wifi_event_group_buffer;
 
 /* The event group allows multiple bits for each event,
    but we only care about one event - are we connected
@@ -50,6 +62,9 @@ const int CONNECTED_BIT = BIT0;
 
 uint8_t wifi_retry = 0;
 
+/* esp_timer time at which IP_EVENT_STA_GOT_IP fired, 0 until then */
+int64_t wifi_got_ip_time_us = 0;
+
 /* store the station info for send back to phone */
 bool gl_sta_connected = false;
 bool gl_sta_got_ip = false;
@@ -59,30 +74,34 @@ uint8_t gl_sta_ssid[32];
 int gl_sta_ssid_len;
 wifi_sta_list_t gl_sta_list;
 bool gl_sta_is_connecting = false;
+#if CONFIG_BT_ENABLED
 esp_blufi_extra_info_t gl_sta_conn_info;
-
-
-esp_err_t save_custom_data_to_nvs(const char* key, const char* value) {
-	nvs_handle_t nvs_handle;
-	esp_err_t err = nvs_open("custom_storage", NVS_READWRITE, &nvs_handle);
+#endif
+
+/* Network bring-up in stages, each one runs at most once and only when a path needs it:
+   netif (TCP/IP stack, event loop, handlers), driver (STA netif, WiFi driver started) and
+   connect. The softAP netif is only created if BLUFI switches to an AP mode. */
+static bool wifi_netif_ready = false;
+static bool wifi_driver_ready = false;
+static bool wifi_connect_requested = false;
+#if CONFIG_BT_ENABLED
+static esp_netif_t *ap_netif = NULL;
+#endif
+
+
+//single field from a "key:value" custom data message, the whole config blob is written again
+esp_err_t save_custom_data_to_nvs(const app_config_field_t *field, const char* value) {
+	esp_err_t err = app_config_set(field, value);
 	if (err != ESP_OK) {
 		return err;
 	}
-
-	err = nvs_set_str(nvs_handle, key, value);
-	if (err != ESP_OK) {
-		nvs_close(nvs_handle);
-		return err;
-	}
-
-	err = nvs_commit(nvs_handle);
-	nvs_close(nvs_handle);
-	return err;
+	return app_config_save();
 }
 
 
 void record_wifi_conn_info(int rssi, uint8_t reason)
 {
+#if CONFIG_BT_ENABLED
 	memset(&gl_sta_conn_info, 0, sizeof(esp_blufi_extra_info_t));
 	if (gl_sta_is_connecting) {
 		gl_sta_conn_info.sta_max_conn_retry_set = true;
@@ -93,6 +112,7 @@ void record_wifi_conn_info(int rssi, uint8_t reason)
 		gl_sta_conn_info.sta_conn_end_reason_set = true;
 		gl_sta_conn_info.sta_conn_end_reason = reason;
 	}
+#endif
 }
 
 void wifi_connect(void)
@@ -117,7 +137,7 @@ bool wifi_reconnect(void)
 	return ret;
 }
 
-
+#if CONFIG_BT_ENABLED
 int softap_get_current_connection_number(void)
 {
 	esp_err_t ret;
@@ -129,30 +149,39 @@ int softap_get_current_connection_number(void)
 
 	return 0;
 }
+#endif
 
 void ip_event_handler(void* arg, esp_event_base_t event_base,
 		int32_t event_id, void* event_data)
 {
-	wifi_mode_t mode;
-
 	switch (event_id) {
 	case IP_EVENT_STA_GOT_IP: {
-		esp_blufi_extra_info_t info;
-
+		wifi_got_ip_time_us = esp_timer_get_time();
+		power_phase_end(POWER_PHASE_WIFI);
 		xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
-		esp_wifi_get_mode(&mode);
+		app_fsm_post(APP_EVENT_WIFI_GOT_IP, 0);
 
-		memset(&info, 0, sizeof(esp_blufi_extra_info_t));
-		memcpy(info.sta_bssid, gl_sta_bssid, 6);
-		info.sta_bssid_set = true;
-		info.sta_ssid = gl_sta_ssid;
-		info.sta_ssid_len = gl_sta_ssid_len;
 		gl_sta_got_ip = true;
+		if (ble_is_connected == false) {
+			//resolve and connect to the upload server while the payload is prepared
+			uplink_warmup_start();
+		}
+#if CONFIG_BT_ENABLED
 		if (ble_is_connected == true) {
+			esp_blufi_extra_info_t info;
+			wifi_mode_t mode;
+
+			esp_wifi_get_mode(&mode);
+			memset(&info, 0, sizeof(esp_blufi_extra_info_t));
+			memcpy(info.sta_bssid, gl_sta_bssid, 6);
+			info.sta_bssid_set = true;
+			info.sta_ssid = gl_sta_ssid;
+			info.sta_ssid_len = gl_sta_ssid_len;
 			esp_blufi_send_wifi_conn_report(mode, ESP_BLUFI_STA_CONN_SUCCESS, softap_get_current_connection_number(), &info);
 		} else {
 			BLE_INFO("BLUFI BLE is not connected yet\n");
 		}
+#endif
 		break;
 	}
 	default:
@@ -166,11 +195,15 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base,
 {
 	wifi_event_sta_connected_t *event;
 	wifi_event_sta_disconnected_t *disconnected_event;
+#if CONFIG_BT_ENABLED
 	wifi_mode_t mode;
+#endif
 
 	switch (event_id) {
 	case WIFI_EVENT_STA_START:
-		wifi_connect();
+		if (wifi_connect_requested) {
+			wifi_connect();
+		}
 		break;
 	case WIFI_EVENT_STA_CONNECTED:
 		gl_sta_connected = true;
@@ -184,6 +217,8 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base,
 		/* Only handle reconnection during connecting */
 		if (gl_sta_connected == false && wifi_reconnect() == false) {
 			gl_sta_is_connecting = false;
+			power_phase_end(POWER_PHASE_WIFI);
+			app_fsm_post(APP_EVENT_WIFI_FAILED, 0);
 			disconnected_event = (wifi_event_sta_disconnected_t*) event_data;
 			record_wifi_conn_info(disconnected_event->rssi, disconnected_event->reason);
 		}
@@ -196,6 +231,7 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base,
 		gl_sta_ssid_len = 0;
 		xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
 		break;
+#if CONFIG_BT_ENABLED
 	case WIFI_EVENT_AP_START:
 		esp_wifi_get_mode(&mode);
 
@@ -219,26 +255,19 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base,
 		}
 		break;
 	case WIFI_EVENT_SCAN_DONE: {
+		//the phone only shows a short list, the first WIFI_LIST_NUM records fit in static buffers
+		static wifi_ap_record_t ap_list[WIFI_LIST_NUM];
+		static esp_blufi_ap_record_t blufi_ap_list[WIFI_LIST_NUM];
 		uint16_t apCount = 0;
 		esp_wifi_scan_get_ap_num(&apCount);
 		if (apCount == 0) {
 			BLE_INFO("Nothing AP found");
 			break;
 		}
-		wifi_ap_record_t *ap_list = (wifi_ap_record_t *)malloc(sizeof(wifi_ap_record_t) * apCount);
-		if (!ap_list) {
-			BLE_ERROR("malloc error, ap_list is NULL");
-			break;
+		if (apCount > WIFI_LIST_NUM) {
+			apCount = WIFI_LIST_NUM;
 		}
 		ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&apCount, ap_list));
-		esp_blufi_ap_record_t * blufi_ap_list = (esp_blufi_ap_record_t *)malloc(apCount * sizeof(esp_blufi_ap_record_t));
-		if (!blufi_ap_list) {
-			if (ap_list) {
-				free(ap_list);
-			}
-			BLE_ERROR("malloc error, blufi_ap_list is NULL");
-			break;
-		}
 		for (int i = 0; i < apCount; ++i)
 		{
 			blufi_ap_list[i].rssi = ap_list[i].rssi;
@@ -252,10 +281,9 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base,
 		}
 
 		esp_wifi_scan_stop();
-		free(ap_list);
-		free(blufi_ap_list);
 		break;
 	}
+#endif
 	case WIFI_EVENT_AP_STACONNECTED: {
 		wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
 		BLE_INFO("station "MACSTR" join, AID=%d", MAC2STR(event->mac), event->aid);
@@ -273,75 +301,132 @@ void wifi_event_handler(void* arg, esp_event_base_t event_base,
 	return;
 }
 
-void initialise_wifi(void)
+static void wifi_netif_init(void)
 {
+	if (wifi_netif_ready) {
+		return;
+	}
 	ESP_ERROR_CHECK(esp_netif_init());
-	wifi_event_group = xEventGroupCreate();
+	wifi_event_group = xEventGroupCreateStatic(&wifi_event_group_buffer);
 	ESP_ERROR_CHECK(esp_event_loop_create_default());
-	esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
-	assert(sta_netif);
-	esp_netif_t *ap_netif = esp_netif_create_default_wifi_ap();
-	assert(ap_netif);
 	ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
 	ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &ip_event_handler, NULL));
+	wifi_netif_ready = true;
+}
+
+//STA netif and driver, started without connecting, BLUFI only needs this much
+void wifi_driver_on(void)
+{
+	if (wifi_driver_ready) {
+		return;
+	}
+	//the driver keeps PHY calibration and its settings in NVS
+	ESP_ERROR_CHECK( app_config_storage_on() );
+	wifi_netif_init();
+	esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
+	assert(sta_netif);
 
 	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 	ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
 	ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
 	record_wifi_conn_info(INVALID_RSSI, INVALID_REASON);
 	ESP_ERROR_CHECK( esp_wifi_start() );
+	wifi_driver_ready = true;
+}
 
-	nvs_handle_t nvs_handle;
-	esp_err_t err = nvs_open("custom_storage", NVS_READONLY, &nvs_handle);
-	if (err == ESP_OK) {
-		size_t required_size;
-
-		// Read custom name data
-		err = nvs_get_str(nvs_handle, "name", NULL, &required_size);
-		if (err == ESP_OK) {
-			char *name_buffer = malloc(required_size);
-			if (name_buffer) {
-				err = nvs_get_str(nvs_handle, "name", name_buffer, &required_size);
-				if (err == ESP_OK) {
-					strncpy(name, name_buffer, ESP_BLUFI_CUSTOM_DATA_MAX_LEN);
-					name[ESP_BLUFI_CUSTOM_DATA_MAX_LEN] = '\0'; // Ensure null-termination
-				}
-				free(name_buffer);
-			}
-		}
+#if CONFIG_BT_ENABLED
+//the AP netif is only needed when the phone asks for softAP or APSTA mode
+static void wifi_ap_netif_on(void)
+{
+	if (ap_netif == NULL) {
+		ap_netif = esp_netif_create_default_wifi_ap();
+		assert(ap_netif);
+	}
+}
+#endif
 
-		// Read custom IP data
-		err = nvs_get_str(nvs_handle, "uri", NULL, &required_size);
-		if (err == ESP_OK) {
-			char *uri_buffer = malloc(required_size);
-			if (uri_buffer) {
-				err = nvs_get_str(nvs_handle, "uri", uri_buffer, &required_size);
-				if (err == ESP_OK) {
-					strncpy(uri, uri_buffer, MAX_IP_LENGTH - 1); // Copy IP address string
-					uri[MAX_IP_LENGTH - 1] = '\0'; // Ensure null-termination
-				}
-				free(uri_buffer);
-			}
-		}
 
-		// Read custom timer data
-		err = nvs_get_str(nvs_handle, "timer", NULL, &required_size);
-		if (err == ESP_OK) {
-			char *timer_buffer = malloc(required_size);
-			if (timer_buffer) {
-				err = nvs_get_str(nvs_handle, "timer", timer_buffer, &required_size);
-				if (err == ESP_OK) {
-					strncpy(timer, timer_buffer, MAX_TIMER_LENGTH - 1); // Copy timer string
-					timer[MAX_TIMER_LENGTH - 1] = '\0'; // Ensure null-termination
-				}
-				free(timer_buffer);
+
+#if CONFIG_BT_ENABLED
+/* Bulk configuration message: BULK_CONFIG_MAGIC, BULK_CONFIG_VERSION, then one tag/length/value
+   entry per field. The whole message is checked against the config field list (app_config.h)
+   before anything is written, then the config blob is stored once with every field in it. */
+
+// walks the entries once, returns the tag that failed in *bad_tag
+static uint8_t bulk_config_validate(const uint8_t *data, uint32_t len, uint8_t *bad_tag)
+{
+	uint32_t seen = 0;
+	uint32_t pos = 2;
+
+	if (len < 2 || data[1] != BULK_CONFIG_VERSION) {
+		return BULK_CONFIG_ERR_FORMAT;
+	}
+	while (pos < len) {
+		if (len - pos < 2 || len - pos - 2 < data[pos + 1]) {
+			return BULK_CONFIG_ERR_FORMAT;
+		}
+		uint8_t tag = data[pos];
+		uint8_t value_len = data[pos + 1];
+		const uint8_t *value = &data[pos + 2];
+		const app_config_field_t *field = app_config_find_tag(tag);
+
+		*bad_tag = tag;
+		if (field == NULL || (seen & (1 << tag)) || value_len == 0 || value_len > field->max_len) {
+			return BULK_CONFIG_ERR_FIELD;
+		}
+		for (int i = 0; i < value_len; i++) {
+			if (value[i] == '\0' || (field->type == APP_CONFIG_TYPE_U32 && (value[i] < '0' || value[i] > '9'))) {
+				return BULK_CONFIG_ERR_FIELD;
 			}
 		}
+		seen |= 1 << tag;
+		pos += 2 + value_len;
+	}
+	*bad_tag = 0;
+	return seen ? BULK_CONFIG_OK : BULK_CONFIG_ERR_FORMAT;
+}
 
-		nvs_close(nvs_handle);
+static uint8_t bulk_config_apply(const uint8_t *data, uint32_t len)
+{
+	char value[APP_CONFIG_STR_MAX + 1];
+	uint32_t pos = 2;
+
+	while (pos < len) {
+		const app_config_field_t *field = app_config_find_tag(data[pos]);
+		uint8_t value_len = data[pos + 1];
+		memcpy(value, &data[pos + 2], value_len);
+		value[value_len] = '\0';
+		BLE_INFO("Bulk config %s: %s", field->key, value);
+		app_config_set(field, value);
+		pos += 2 + value_len;
 	}
+	esp_err_t err = app_config_save();
+	if (err != ESP_OK) {
+		BLE_ERROR("Bulk config: saving failed: %s", esp_err_to_name(err));
+		return BULK_CONFIG_ERR_STORAGE;
+	}
+	return BULK_CONFIG_OK;
 }
 
+// answers with BULK_CONFIG_MAGIC, the status and the offending tag (0 when none)
+static void bulk_config_receive(const uint8_t *data, uint32_t len)
+{
+	uint8_t bad_tag = 0;
+	uint8_t status = bulk_config_validate(data, len, &bad_tag);
+
+	if (status == BULK_CONFIG_OK) {
+		status = bulk_config_apply(data, len);
+	} else {
+		BLE_ERROR("Bulk config rejected, status %u tag %u", status, bad_tag);
+	}
+
+	uint8_t ack[3] = { BULK_CONFIG_MAGIC, status, bad_tag };
+	esp_blufi_send_custom_data(ack, sizeof(ack));
+}
+
+/* esp_timer time and free heap when blufi_func started */
+static int64_t blufi_init_start_us;
+static size_t blufi_init_free_heap;
 
 esp_blufi_callbacks_t callbacks = {
 		.event_cb = event_callback,
@@ -362,6 +447,9 @@ void event_callback(esp_blufi_cb_event_t event, esp_blufi_cb_param_t *param)
 		BLE_INFO("BLUFI init finish\n");
 
 		esp_blufi_adv_start();
+		BLE_INFO("BLUFI advertising %lld ms after init, heap %u bytes free, %u used by BLE\n",
+				(esp_timer_get_time() - blufi_init_start_us) / 1000, esp_get_free_heap_size(),
+				blufi_init_free_heap - esp_get_free_heap_size());
 		break;
 
 
@@ -388,6 +476,9 @@ void event_callback(esp_blufi_cb_event_t event, esp_blufi_cb_param_t *param)
 
 	case ESP_BLUFI_EVENT_SET_WIFI_OPMODE:
 		BLE_INFO("BLUFI Set WIFI opmode %d\n", param->wifi_mode.op_mode);
+		if (param->wifi_mode.op_mode == WIFI_MODE_AP || param->wifi_mode.op_mode == WIFI_MODE_APSTA) {
+			wifi_ap_netif_on();
+		}
 		ESP_ERROR_CHECK( esp_wifi_set_mode(param->wifi_mode.op_mode) );
 		break;
 
@@ -470,6 +561,12 @@ void event_callback(esp_blufi_cb_event_t event, esp_blufi_cb_param_t *param)
 
 		// Custom set up for device. Name of IoT node, IP/URL for server and Deep sleep timer in seconds.
 	case ESP_BLUFI_EVENT_RECV_CUSTOM_DATA: {
+		// all fields in one message, not capped at the single field buffer below
+		if (param->custom_data.data_len > 0 && param->custom_data.data[0] == BULK_CONFIG_MAGIC) {
+			bulk_config_receive(param->custom_data.data, param->custom_data.data_len);
+			break;
+		}
+
 		// Ensure the custom data length does not exceed the buffer size
 		uint16_t data_len = param->custom_data.data_len;
 		if (data_len > ESP_BLUFI_CUSTOM_DATA_MAX_LEN) {
@@ -481,31 +578,14 @@ void event_callback(esp_blufi_cb_event_t event, esp_blufi_cb_param_t *param)
 		memcpy(data_buffer, param->custom_data.data, data_len);
 		data_buffer[data_len] = '\0'; // Null terminate the string
 
-		//Name Data
-		if (strncmp(data_buffer, "name:", 5) == 0) {
-			const char* name = &data_buffer[5]; // Skip "name:"
-			printf("Received name: %s \n", name);
-			esp_err_t nvs_err = save_custom_data_to_nvs("name", name);
+		// "key:value" with a key from the config field list, found in app_config.h
+		const char *separator = strchr(data_buffer, ':');
+		const app_config_field_t *field = separator ? app_config_find_key(data_buffer, separator - data_buffer) : NULL;
+		if (field != NULL) {
+			printf("Received %s: %s \n", field->key, separator + 1);
+			esp_err_t nvs_err = save_custom_data_to_nvs(field, separator + 1);
 			if (nvs_err != ESP_OK) {
-				printf("Error saving name to NVS: %s\n", esp_err_to_name(nvs_err));
-			}
-
-			//IP data
-		} else if (strncmp(data_buffer, "uri:", 4) == 0) {
-			const char* uri = &data_buffer[4]; // Skip "ip:"
-			printf("Received URI address: %s \n", uri);
-			esp_err_t nvs_err = save_custom_data_to_nvs("uri", uri);
-			if (nvs_err != ESP_OK) {
-				printf("Error saving URI address to NVS: %s\n", esp_err_to_name(nvs_err));
-			}
-
-			//Timer Data
-		} else if (strncmp(data_buffer, "timer:", 6) == 0) {
-			const char* timer = &data_buffer[6]; // Skip "timer:"
-			printf("Received timer: %s \n", timer);
-			esp_err_t nvs_err = save_custom_data_to_nvs("timer", timer);
-			if (nvs_err != ESP_OK) {
-				printf("Error saving timer to NVS: %s\n", esp_err_to_name(nvs_err));
+				printf("Error saving %s to NVS: %s\n", field->key, esp_err_to_name(nvs_err));
 			}
 		} else {
 			// if not a recognized prefix
@@ -537,6 +617,10 @@ void blufi_func(void)
 {
 	esp_err_t ret;
 
+	//compared against ESP_BLUFI_EVENT_INIT_FINISH to report the cost of the BLE host
+	blufi_init_start_us = esp_timer_get_time();
+	blufi_init_free_heap = esp_get_free_heap_size();
+
 	ret = esp_blufi_controller_init();
 	if (ret) {
 		BLE_ERROR("%s BLUFI controller init failed: %s\n", __func__, esp_err_to_name(ret));
@@ -576,19 +660,65 @@ void ble_deinit(void)
 	BLE_INFO("BLUFI deinit");
 
 }
+#endif
 
+//status check for the state machine, leaves the WiFi power phase running
+bool wifi_has_ip(void) {
+	return wifi_event_group != NULL && (xEventGroupGetBits(wifi_event_group) & CONNECTED_BIT) != 0;
+}
+
+//only called on wakes that upload, sample-only wakes never touch the network stack
 void wifi_on(void){
-	esp_err_t ret;
-	ret = nvs_flash_init();
-	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-		ESP_ERROR_CHECK(nvs_flash_erase());
-		ret = nvs_flash_init();
+	if (wifi_connect_requested) {
+		return;
 	}
-	ESP_ERROR_CHECK(ret);
+	wifi_connect_requested = true;
 
-	initialise_wifi();
+	//started for BLUFI earlier, the phone may have connected us already
+	if (wifi_has_ip()) {
+		return;
+	}
+	//CPU stays at max until the station has an IP or gives up
+	power_phase_begin(POWER_PHASE_WIFI);
+	if (wifi_driver_ready) {
+		//WIFI_EVENT_STA_START has already fired
+		wifi_connect();
+	} else {
+		wifi_driver_on();
+	}
+}
 
+//the next wifi_on connects again, for a retry after the credentials were provisioned
+void wifi_connect_reset(void) {
+	wifi_connect_requested = false;
+}
 
+//stay associated between samples, the radio only wakes for every listen_interval-th beacon
+esp_err_t wifi_enable_modem_sleep(uint16_t listen_interval) {
+	wifi_config_t config;
+	esp_err_t err = esp_wifi_get_config(WIFI_IF_STA, &config);
+	if (err == ESP_OK) {
+		config.sta.listen_interval = listen_interval;
+		err = esp_wifi_set_config(WIFI_IF_STA, &config);
+	}
+	if (err == ESP_OK) {
+		err = esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+	}
+	return err;
+}
+
+//blocks until the station has an IP address, returns false on timeout. The WiFi power phase
+//only ends when the IP arrived, a failed connection ends it from the event handler
+bool wait_for_wifi_connection(TickType_t timeout) {
+	if (wifi_event_group == NULL) {
+		return false;
+	}
+	EventBits_t bits = xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, pdFALSE, pdTRUE, timeout);
+	if ((bits & CONNECTED_BIT) == 0) {
+		return false;
+	}
+	power_phase_end(POWER_PHASE_WIFI);
+	return true;
 }
 
 bool is_wifi_connected(void) {
@@ -8,23 +8,27 @@
 #ifndef MAIN_WIFI_H_
 #define MAIN_WIFI_H_
 
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 
 #define ESP_BLUFI_CUSTOM_DATA_MAX_LEN 256 // Maximum length of custom data
-#define MAX_IP_LENGTH 256 // Maximum length of an IP address
-#define MAX_TIMER_LENGTH 16 // Maximum length of the timer
 
 #define WIFI_CONNECTION_MAXIMUM_RETRY 9
 extern uint8_t wifi_retry;
+extern int64_t wifi_got_ip_time_us;
 
-extern char name[ESP_BLUFI_CUSTOM_DATA_MAX_LEN + 1];
-extern char timer[MAX_TIMER_LENGTH];
-extern char uri[MAX_IP_LENGTH];
 
 
 void blufi_func(void);
 void ble_deinit(void);
+void wifi_driver_on(void);
 void wifi_on(void);
+void wifi_connect_reset(void);
 bool is_wifi_connected(void);
+bool wait_for_wifi_connection(TickType_t timeout);
+bool wifi_has_ip(void);
+esp_err_t wifi_enable_modem_sleep(uint16_t listen_interval);
 void wifi_connect(void);
 bool wifi_reconnect(void);
 #endif /* MAIN_WIFI_H_ */
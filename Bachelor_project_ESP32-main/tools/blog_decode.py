@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Decode the binary log written by main/blog.c.
+
+The device dumps the ring with blog_flush as "BLOG:" lines in the monitor output. A record
+holds the address of its format string, this script reads the string from the app ELF the
+records were made with and formats the arguments.
+
+    python tools/blog_decode.py build/main.elf monitor.log
+    idf.py monitor | python tools/blog_decode.py build/main.elf
+
+The ring can also be read over JTAG without the UART, with gdb:
+    dump binary value ring.bin ring
+    python tools/blog_decode.py build/main.elf --dump ring.bin
+
+Needs pyelftools, which is installed with ESP-IDF.
+"""
+
+import argparse
+import hashlib
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+BLOG_MAX_ARGS = 4
+RECORD = struct.Struct("<IIHBB%dI" % BLOG_MAX_ARGS)
+HEADER = struct.Struct("<I4sHHHH")
+BLOG_MAGIC = 0x424C4F47
+BLOG_RING_ENTRIES = 32
+
+LEVELS = {1: "E", 2: "W", 3: "I", 4: "D", 5: "V"}
+
+# C conversion without the length modifiers, e.g. %lu -> %u
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z|j|t)?([diouxXeEfgGcs%])")
+
+
+class Strings:
+    def __init__(self, path):
+        self.sections = []
+        with open(path, "rb") as f:
+            self.sha = hashlib.sha256(f.read()).hexdigest()[:8]
+            f.seek(0)
+            for section in ELFFile(f).iter_sections():
+                if section["sh_addr"] and section["sh_type"] == "SHT_PROGBITS":
+                    self.sections.append((section["sh_addr"], section.data()))
+
+    def string(self, addr):
+        for start, data in self.sections:
+            if start <= addr < start + len(data):
+                end = data.index(b"\0", addr - start)
+                return data[addr - start:end].decode("utf-8", "replace")
+        return None
+
+
+def format_record(fmt, args):
+    args = list(args)
+    out = []
+    pos = 0
+    for match in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:match.start()])
+        pos = match.end()
+        flags, _, conv = match.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+        value = args.pop(0) if args else 0
+        if conv in "eEfgG":
+            value = struct.unpack("<f", struct.pack("<I", value))[0]
+        elif conv in "di":
+            value = struct.unpack("<i", struct.pack("<I", value))[0]
+        elif conv == "c":
+            value = chr(value & 0xFF)
+        elif conv == "s":
+            conv, value = "s", "<str 0x%08x>" % value
+        elif conv == "u":
+            conv = "d"
+        out.append(("%" + flags + conv) % value)
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def decode(strings, raw):
+    fmt_addr, time_ms, wake, level, nargs, *args = RECORD.unpack(raw)
+    fmt = strings.string(fmt_addr)
+    if fmt is None:
+        text = "<unknown format 0x%08x> %s" % (fmt_addr, " ".join("0x%08x" % a for a in args[:nargs]))
+    else:
+        text = format_record(fmt, args[:nargs])
+    return "%s (%d) wake %d: %s" % (LEVELS.get(level, "?"), time_ms, wake, text.rstrip())
+
+
+def check_sha(strings, sha):
+    if sha != strings.sha:
+        print("warning: records are from ELF %s, the given ELF is %s" % (sha, strings.sha), file=sys.stderr)
+
+
+def decode_lines(strings, lines):
+    for line in lines:
+        index = line.find("BLOG:")
+        if index < 0:
+            continue
+        payload = line[index + 5:].strip()
+        if ":" in payload:
+            sha, count = payload.split(":")
+            check_sha(strings, sha)
+            print("-- %s records" % count)
+        else:
+            print(decode(strings, bytes.fromhex(payload)))
+
+
+def decode_dump(strings, path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, sha, _, head, count, _ = HEADER.unpack_from(data)
+    if magic != BLOG_MAGIC:
+        sys.exit("no binary log in %s" % path)
+    check_sha(strings, sha.hex())
+    print("-- %d records" % count)
+    for i in range(count):
+        slot = (head + BLOG_RING_ENTRIES - count + i) % BLOG_RING_ENTRIES
+        print(decode(strings, data[HEADER.size + slot * RECORD.size:][:RECORD.size]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="app ELF the log was recorded with")
+    parser.add_argument("log", nargs="?", help="monitor output, stdin when left out")
+    parser.add_argument("--dump", help="raw copy of the RTC ring instead of monitor output")
+    args = parser.parse_args()
+
+    strings = Strings(args.elf)
+    if args.dump:
+        decode_dump(strings, args.dump)
+    elif args.log:
+        with open(args.log, errors="replace") as f:
+            decode_lines(strings, f)
+    else:
+        decode_lines(strings, sys.stdin)
+
+
+if __name__ == "__main__":
+    main()
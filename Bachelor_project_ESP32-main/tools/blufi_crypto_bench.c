@@ -0,0 +1,295 @@
+/*
+ * blufi_crypto_bench.c
+ *
+ *  Host build of the BLUFI cipher path and the two key exchanges in main/ble_sec.c against the
+ *  system mbedtls. The host library has no AES_ALT, so this measures the software AES that the
+ *  firmware falls back to without CONFIG_MBEDTLS_HARDWARE_AES. BLUFI_AES_BENCHMARK in ble.h
+ *  gives the hardware numbers on the device, blufi_dh_negotiate_data_handler logs the time and
+ *  heap of each handshake there. Needs mbedtls 3.x, the version ESP-IDF 5.2 ships:
+ *
+ *      cc -O2 -o blufi_crypto_bench tools/blufi_crypto_bench.c -lmbedcrypto
+ *      ./blufi_crypto_bench [packets]
+ *
+ *  The peak mbedtls allocation of a handshake is only reported when the library is built with
+ *  MBEDTLS_PLATFORM_MEMORY, as ESP-IDF builds it.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "mbedtls/platform.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/dhm.h"
+#include "mbedtls/md5.h"
+#include "mbedtls/ecdh.h"
+#include "mbedtls/hkdf.h"
+#include "mbedtls/md.h"
+
+#define PSK_LEN 16
+#define X25519_KEY_LEN 32
+#define DH_KEY_LEN 128
+#define BLUFI_HKDF_INFO "blufi-x25519-aes128"
+#define BENCH_PACKETS 1000				// default, as BLUFI_AES_BENCHMARK_PACKETS
+#define BENCH_HANDSHAKES 20
+
+//1024-bit MODP group of RFC 2409, the size the BLUFI phone apps use
+#define DH_P_HEX "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74" \
+		"020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437" \
+		"4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED" \
+		"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE65381FFFFFFFFFFFFFFFF"
+
+static mbedtls_aes_context aes;
+static uint8_t iv[16];
+
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+#define BENCH_COUNT_HEAP 1
+//every mbedtls allocation goes through here, the size sits in front of the block
+static size_t heap_now, heap_peak;
+
+static void *count_calloc(size_t n, size_t size) {
+	size_t bytes = n * size;
+	max_align_t *block = calloc(1, sizeof(max_align_t) + bytes);
+	if (block == NULL) {
+		return NULL;
+	}
+	*(size_t *)block = bytes;
+	heap_now += bytes;
+	heap_peak = (heap_now > heap_peak) ? heap_now : heap_peak;
+	return block + 1;
+}
+
+static void count_free(void *ptr) {
+	if (ptr != NULL) {
+		max_align_t *block = (max_align_t *)ptr - 1;
+		heap_now -= *(size_t *)block;
+		free(block);
+	}
+}
+#else
+#define BENCH_COUNT_HEAP 0
+static size_t heap_now, heap_peak;
+#endif
+
+static int64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//blufi_aes_encrypt without the power phase
+static int blufi_aes_encrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len) {
+	size_t iv_offset = 0;
+	uint8_t iv0[16];
+
+	memcpy(iv0, iv, sizeof(iv));
+	iv0[0] = iv8;
+	if (mbedtls_aes_crypt_cfb128(&aes, MBEDTLS_AES_ENCRYPT, crypt_len, &iv_offset, iv0, crypt_data, crypt_data)) {
+		return -1;
+	}
+	return crypt_len;
+}
+
+static int myrand(void *rng_state, unsigned char *output, size_t len) {
+	return getrandom(output, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+//device side of SEC_TYPE_DH_PARAM_DATA in blufi_dh_negotiate, params holds P, G and the phone's key
+static int dh_negotiate(uint8_t *params, size_t params_len, uint8_t *psk) {
+	mbedtls_dhm_context dhm;
+	uint8_t self_public_key[DH_KEY_LEN];
+	uint8_t share_key[DH_KEY_LEN];
+	size_t share_len;
+	uint8_t *p = params;
+
+	mbedtls_dhm_init(&dhm);
+	int ret = mbedtls_dhm_read_params(&dhm, &p, params + params_len);
+	const int dhm_len = (int)mbedtls_dhm_get_len(&dhm);
+	if (ret == 0) {
+		ret = mbedtls_dhm_make_public(&dhm, dhm_len, self_public_key, dhm_len, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_dhm_calc_secret(&dhm, share_key, sizeof(share_key), &share_len, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_md5(share_key, share_len, psk);
+	}
+	if (ret == 0) {
+		ret = mbedtls_aes_setkey_enc(&aes, psk, 128);
+	}
+	mbedtls_dhm_free(&dhm);
+	return ret;
+}
+
+//blufi_x25519_negotiate
+static int x25519_negotiate(const uint8_t *peer_public, uint8_t *psk) {
+	mbedtls_ecp_group grp;
+	mbedtls_mpi d, z;
+	mbedtls_ecp_point q, peer_q;
+	uint8_t self_public_key[X25519_KEY_LEN];
+	uint8_t shared[X25519_KEY_LEN];
+	size_t olen;
+
+	mbedtls_ecp_group_init(&grp);
+	mbedtls_mpi_init(&d);
+	mbedtls_mpi_init(&z);
+	mbedtls_ecp_point_init(&q);
+	mbedtls_ecp_point_init(&peer_q);
+
+	int ret = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519);
+	if (ret == 0) {
+		ret = mbedtls_ecdh_gen_public(&grp, &d, &q, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecp_point_write_binary(&grp, &q, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen,
+				self_public_key, X25519_KEY_LEN);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecp_point_read_binary(&grp, &peer_q, peer_public, X25519_KEY_LEN);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecdh_compute_shared(&grp, &z, &peer_q, &d, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_mpi_write_binary_le(&z, shared, sizeof(shared));
+	}
+	if (ret == 0) {
+		ret = mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), NULL, 0, shared, sizeof(shared),
+				(const uint8_t *)BLUFI_HKDF_INFO, strlen(BLUFI_HKDF_INFO), psk, PSK_LEN);
+	}
+	if (ret == 0) {
+		ret = mbedtls_aes_setkey_enc(&aes, psk, 128);
+	}
+
+	mbedtls_ecp_point_free(&peer_q);
+	mbedtls_ecp_point_free(&q);
+	mbedtls_mpi_free(&z);
+	mbedtls_mpi_free(&d);
+	mbedtls_ecp_group_free(&grp);
+	return ret;
+}
+
+//what the phone sends for each exchange, made once outside the timed part
+static int phone_dh_params(uint8_t *params, size_t *params_len) {
+	mbedtls_dhm_context dhm;
+	mbedtls_mpi P, G;
+
+	mbedtls_dhm_init(&dhm);
+	mbedtls_mpi_init(&P);
+	mbedtls_mpi_init(&G);
+	int ret = mbedtls_mpi_read_string(&P, 16, DH_P_HEX);
+	if (ret == 0) {
+		ret = mbedtls_mpi_lset(&G, 2);
+	}
+	if (ret == 0) {
+		ret = mbedtls_dhm_set_group(&dhm, &P, &G);
+	}
+	if (ret == 0) {
+		ret = mbedtls_dhm_make_params(&dhm, DH_KEY_LEN, params, params_len, myrand, NULL);
+	}
+	mbedtls_mpi_free(&G);
+	mbedtls_mpi_free(&P);
+	mbedtls_dhm_free(&dhm);
+	return ret;
+}
+
+static int phone_x25519_public(uint8_t *public_key) {
+	mbedtls_ecp_group grp;
+	mbedtls_mpi d;
+	mbedtls_ecp_point q;
+	size_t olen;
+
+	mbedtls_ecp_group_init(&grp);
+	mbedtls_mpi_init(&d);
+	mbedtls_ecp_point_init(&q);
+	int ret = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519);
+	if (ret == 0) {
+		ret = mbedtls_ecdh_gen_public(&grp, &d, &q, myrand, NULL);
+	}
+	if (ret == 0) {
+		ret = mbedtls_ecp_point_write_binary(&grp, &q, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, public_key, X25519_KEY_LEN);
+	}
+	mbedtls_ecp_point_free(&q);
+	mbedtls_mpi_free(&d);
+	mbedtls_ecp_group_free(&grp);
+	return ret;
+}
+
+//mean time and peak mbedtls heap of the device side, as the handshake log line on the device
+static void handshake_benchmark(void) {
+	uint8_t params[3 * (DH_KEY_LEN + 2)];
+	size_t params_len;
+	uint8_t peer_public[X25519_KEY_LEN];
+	uint8_t psk[PSK_LEN];
+
+	if (phone_dh_params(params, &params_len) != 0 || phone_x25519_public(peer_public) != 0) {
+		fprintf(stderr, "phone side key generation failed\n");
+		return;
+	}
+
+	for (int kind = 0; kind < 2; kind++) {
+		int64_t total_us = 0;
+		size_t peak = 0;
+		for (int n = 0; n < BENCH_HANDSHAKES; n++) {
+			heap_peak = heap_now;
+			size_t heap_start = heap_now;
+			int64_t start_us = now_us();
+			int ret = kind == 0 ? dh_negotiate(params, params_len, psk) : x25519_negotiate(peer_public, psk);
+			total_us += now_us() - start_us;
+			if (ret != 0) {
+				fprintf(stderr, "%s handshake failed: -0x%04x\n", kind == 0 ? "dh1024" : "x25519", (unsigned)-ret);
+				return;
+			}
+			peak = (heap_peak - heap_start > peak) ? heap_peak - heap_start : peak;
+		}
+		if (BENCH_COUNT_HEAP) {
+			printf("%s handshake: %lld us, heap peak %zu bytes\n", kind == 0 ? "dh1024" : "x25519",
+					(long long)(total_us / BENCH_HANDSHAKES), peak);
+		} else {
+			printf("%s handshake: %lld us\n", kind == 0 ? "dh1024" : "x25519", (long long)(total_us / BENCH_HANDSHAKES));
+		}
+	}
+}
+
+//same frame sizes and output as blufi_aes_benchmark
+static void aes_benchmark(int packets) {
+	static const int frame_sizes[] = { 16, 64, 128, 244 };
+	static uint8_t frame[244];
+	uint8_t psk[PSK_LEN];
+
+	memset(psk, 0x5a, sizeof(psk));
+	mbedtls_aes_setkey_enc(&aes, psk, 128);
+
+	for (int i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+		int64_t start_us = now_us();
+		for (int n = 0; n < packets; n++) {
+			blufi_aes_encrypt((uint8_t)n, frame, frame_sizes[i]);
+		}
+		int64_t elapsed_us = now_us() - start_us;
+		if (elapsed_us <= 0) {
+			elapsed_us = 1;
+		}
+		printf("aes-cfb128 %3d byte frames: %lld packets/s, %lld bytes/s\n", frame_sizes[i],
+				(long long)(packets * 1000000LL / elapsed_us), (long long)((int64_t)packets * frame_sizes[i] * 1000000LL / elapsed_us));
+	}
+}
+
+int main(int argc, char **argv) {
+	int packets = (argc > 1) ? atoi(argv[1]) : BENCH_PACKETS;
+	if (packets <= 0) {
+		fprintf(stderr, "usage: %s [packets]\n", argv[0]);
+		return 1;
+	}
+
+#if BENCH_COUNT_HEAP
+	mbedtls_platform_set_calloc_free(count_calloc, count_free);
+#endif
+	mbedtls_aes_init(&aes);
+	handshake_benchmark();
+	aes_benchmark(packets);
+	mbedtls_aes_free(&aes);
+	return 0;
+}